@@ -33,6 +33,12 @@
  *    NDEBUG  0x0A00  (2560)  BOOTSIZE= 5 sectors
  *    DEBUG1  0x2000  (8192)  BOOTSIZE=16 sectors
  *
+ *  Enabling any of the optional CONFIG_ features below that are commented
+ *  out by default also moves it, because the base image nearly fills
+ *  5 sectors. See APPSTART in fuse.c.
+ *
+ *    OPTION  0x1000  (4096)  BOOTSIZE= 8 sectors
+ *
  *  The DEBUG=0 output is not normally used,
  *  but can be used to filter only user-defined output.
  */
@@ -77,6 +83,154 @@
   #endif
 #endif
 
+/*
+ * USERROW/BOOTROW write cache
+ *
+ *  Writes to USERROW and BOOTROW are collected in RAM, and the row is
+ *  erased and written once: on CMD3_LEAVE_PROGMODE or CMD3_SIGN_OFF,
+ *  on a read of the same row, on an access to another row, on an erase,
+ *  or on disconnect. The cache adds 512 bytes to the work area.
+ *  Otherwise every chunk is written through.
+ *
+ *  The boot section grows to 8 sectors.
+ */
+
+// #define CONFIG_NVM_ROWCACHE
+
+/*
+ * Command batch
+ *
+ *  CMD3_VENDOR_BATCH (0xE0) runs a list of AVR scope commands that do
+ *  not write NVM (parameters, sign-on, enter progmode and memory reads)
+ *  from one EDBG payload and returns all results in one response.
+ */
+
+// #define CONFIG_JTAG_BATCH
+
+/*
+ * DAP command queue
+ *
+ *  Accepts DAP_QueueCommands (0x7E) and DAP_ExecuteCommands (0x7F), which
+ *  carry several DAP commands in one report and return one combined
+ *  response. A short EDBG command and the read of its response (0x80 and
+ *  0x81) can then share one report.
+ */
+
+// #define CONFIG_DAP_QUEUE
+
+/*
+ * Replay of retransmitted NVM commands
+ *
+ *  A host that times out resends a command with the same sequence number.
+ *  CMD3_WRITE_MEMORY, CMD3_ERASE_MEMORY, fill and copy are then not run
+ *  again: the status of the first run is kept and returned. The EDBG
+ *  diagnostics count retransmits and replays.
+ */
+
+// #define CONFIG_JTAG_REPLAY
+
+/*
+ * Fill and copy
+ *
+ *  CMD3_VENDOR_FILL (0xE2) fills a memory range with a repeated pattern,
+ *  and CMD3_VENDOR_COPY (0xE3) copies a range to another address or
+ *  memory type, both on the device and one page at a time.
+ */
+
+// #define CONFIG_NVM_FILLCOPY
+
+/*
+ * Background NVM jobs
+ *
+ *  Multi-page erases, CMD3_VENDOR_FILL/COPY, the CRCSCAN footer and the
+ *  CMD3_VENDOR_JOURNAL CRC are run as jobs of short steps: one erase
+ *  block, one page or one EEPROM pair at a time. With this enabled the main loop takes the steps, so
+ *  EP0 control requests and bus events are served between them, and the
+ *  response is published when the job ends. Without it, each job runs to
+ *  its end inside the command, and the fill pattern is limited to the
+ *  part of the work buffer that EP0 does not use.
+ *
+ *  The boot section grows to 8 sectors.
+ */
+
+// #define CONFIG_NVM_BACKGROUND
+
+/*
+ * Programming journal
+ *
+ *  The last 6 bytes of EEPROM record the image being written and the
+ *  first flash page not yet written, so that an upload cut off by a
+ *  disconnect or power loss can be resumed. The host drives it with
+ *  CMD3_VENDOR_JOURNAL (0xE4). Those EEPROM bytes are then not
+ *  available to the application.
+ */
+
+// #define CONFIG_NVM_JOURNAL
+
+/*
+ * CRCSCAN footer
+ *
+ *  If flash was erased or written in a session, CMD3_LEAVE_PROGMODE
+ *  stores the inverted CRC-32 (the `gencrc.pl -c6` model) of all other
+ *  flash in the last 4 bytes of flash. A CRCSCAN of the whole flash then
+ *  passes after any update, even a partial one. Those 4 bytes must not
+ *  be used by the application. With CONFIG_SYS_SLOTS, the CRC covers
+ *  only the slot that was programmed and is stored in its last 4 bytes.
+ *  CRCSCAN can only check BOOT, BOOT+APP or the whole flash, so a slot
+ *  footer must be checked by software: the CRC-32 of the slot, footer
+ *  included, ends on the model residue.
+ */
+
+// #define CONFIG_NVM_CRCFOOTER
+
+/*
+ * A/B application slots
+ *
+ *  When enabled, the application region above the boot section is split
+ *  into two slots of equal size in whole pages. The slot that starts is
+ *  chosen by a log in the last 16 bytes of BOOTROW and of USERROW, and
+ *  CMD3_VENDOR_SLOT (0xE1) switches it with a single byte write. Those
+ *  bytes cannot be written or erased by the host. The starting slot
+ *  cannot be written or erased either, so uploads always go to the other
+ *  slot.
+ *
+ *  Each image must be linked for the start address of its slot.
+ *  The AVR-DU interrupt vectors are fixed at the start of the application
+ *  region, which is slot A, so an image in slot B cannot use interrupts.
+ *
+ *  The boot section grows to 8 sectors.
+ */
+
+// #define CONFIG_SYS_SLOTS
+
+/*
+ * Page services for applications
+ *
+ *  Places ABI version 1 at the start of the boot section: RJMP entries
+ *  for whole-page write, multi-page erase and update-if-different, which
+ *  an application can call to rewrite its own flash. Without it, the ABI
+ *  word at $26 reads version 0 and only the SPM snippets are available.
+ *
+ *  The boot section grows to 8 sectors.
+ */
+
+// #define CONFIG_NVM_PAGESERVICE
+
+/*
+ * USB services for applications
+ *
+ *  Extends the page service ABI at the start of the boot section to
+ *  version 2 with four USB entries: device setup, endpoint listen,
+ *  endpoint pending and a poll that handles bus events and the standard
+ *  EP0 requests. An application passes its own EP table, descriptors and
+ *  request callback in a USB_App_t, so no bootloader RAM is used.
+ *  It requires CONFIG_NVM_PAGESERVICE.
+ *
+ *  The boot section grows to 8 sectors.
+ */
+
+// #define CONFIG_USB_APPTABLE
+
 /*
  * Bootloader Status LED
  *
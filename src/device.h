@@ -0,0 +1,79 @@
+/**
+ * @file device.h
+ * @author askn (K.Sato) multix.jp
+ * @brief `euboot` (EDBG USB Bootloader) is a USB bootloader for AVR-DU series that runs
+ *        at full USB 2.0 speed. It is recognized as a HID/CMSIS-DAP/EDBG device in
+ *        AVRDUDE>=8.0 and can read all memory areas and write to FLASH, EEPROM, USERROW
+ *        and BOOTROW areas. It cannot change FUSE and LOCKBIT or erase the chip.
+ *        To start `euboot`, connect it to a USB port while holding down the configured
+ *        button (or shorting it to GND) and power it on. If successful, the configured
+ *        LED will blink in a specific pattern and wait for a connection from AVRDUDE.
+ *        No automatic reset from Atduino IDE/CLI is possible.
+ * @version 3.72.48+
+ * @date 2024-11-01
+ * @copyright Copyright (c) 2024 askn37 at github.com
+ * @link Product Potal : https://askn37.github.io/
+ *         MIT License : https://askn37.github.io/LICENSE.html
+ */
+
+#pragma once
+#include <avr/io.h>
+#include <stdint.h>
+
+/*
+ * AVR-DU device profiles
+ *
+ *  The part is chosen by the -mmcu macro, and everything that depends
+ *  on it is a compile-time constant, so address checks fold away.
+ *
+ *    Part       Flash   SRAM   FLMAP sections  Packages
+ *    AVR16DUxx  16KiB   2KiB   1               14/20/28/32 pin
+ *    AVR32DUxx  32KiB   4KiB   1               14/20/28/32 pin
+ *    AVR64DUxx  64KiB   8KiB   2               28/32 pin
+ *
+ *  All parts share the 512-byte flash page and the NVM version 4 SIB.
+ */
+
+namespace DEVICE {
+
+  template <uint8_t FLASH_KIB, uint8_t PINS>
+  struct Profile {
+    static constexpr uint32_t flash_size     = FLASH_KIB * 1024UL;
+    static constexpr uint16_t page_size      = 512;
+    static constexpr uint16_t sram_size      = FLASH_KIB * 128U;
+    static constexpr uint8_t  flmap_sections = (flash_size + 0x7FFF) / 0x8000;
+    static constexpr uint8_t  pins           = PINS;
+  };
+
+#if   defined(__AVR_AVR64DU32__)
+  typedef Profile<64, 32> Current;
+#elif defined(__AVR_AVR64DU28__)
+  typedef Profile<64, 28> Current;
+#elif defined(__AVR_AVR32DU32__)
+  typedef Profile<32, 32> Current;
+#elif defined(__AVR_AVR32DU28__)
+  typedef Profile<32, 28> Current;
+#elif defined(__AVR_AVR32DU20__)
+  typedef Profile<32, 20> Current;
+#elif defined(__AVR_AVR32DU14__)
+  typedef Profile<32, 14> Current;
+#elif defined(__AVR_AVR16DU32__)
+  typedef Profile<16, 32> Current;
+#elif defined(__AVR_AVR16DU28__)
+  typedef Profile<16, 28> Current;
+#elif defined(__AVR_AVR16DU20__)
+  typedef Profile<16, 20> Current;
+#elif defined(__AVR_AVR16DU14__)
+  typedef Profile<16, 14> Current;
+#else
+  #error "euboot supports the AVR-DU series only"
+#endif
+
+  /* The profile must agree with the device header. */
+  static_assert(Current::flash_size == PROGMEM_SIZE, "flash size mismatch");
+  static_assert(Current::page_size  == PROGMEM_PAGE_SIZE, "flash page size mismatch");
+  static_assert(Current::sram_size  == INTERNAL_SRAM_SIZE, "SRAM size mismatch");
+
+};
+
+// end of header
@@ -37,8 +37,21 @@
   #define ENABLE_SYS_RESET 0
 #endif
 
+/*
+ * The base image nearly fills 5 sectors, so any optional feature moves
+ * the application to 8 sectors (0x1000). `make` checks that the image
+ * and its CRC32 fit in the BOOTSIZE written here.
+ */
+
 #if defined(DEBUG) && !defined(NDEBUG)
   #define APPSTART 16
+#elif defined(CONFIG_NVM_PAGESERVICE) || defined(CONFIG_USB_APPTABLE) \
+   || defined(CONFIG_JTAG_BATCH) || defined(CONFIG_DAP_QUEUE) \
+   || defined(CONFIG_JTAG_REPLAY) || defined(CONFIG_NVM_FILLCOPY) \
+   || defined(CONFIG_SYS_SLOTS) \
+   || defined(CONFIG_NVM_JOURNAL) || defined(CONFIG_NVM_CRCFOOTER) \
+   || defined(CONFIG_NVM_ROWCACHE) || defined(CONFIG_NVM_BACKGROUND)
+  #define APPSTART 8
 #else
   #define APPSTART 5
 #endif
@@ -47,18 +47,28 @@ namespace JTAG {
   const uint8_t PROGMEM jtag_version[] = CONFIG_SYS_FWVER;
   const uint8_t PROGMEM jtag_physical[] = {0x90, 0x28, 0x00, 0x18, 0x38, 0x00, 0x00, 0x00};
 
+  /* Size of the next response fragment, or 0 if none is pending. */
+  uint8_t dap_fragment_size (void) {
+    if (_packet_endfrag == 0) return 0;
+    return _packet_fragment + 1 == _packet_endfrag ? _packet_length : 60;
+  }
+
   /*** Only a subset of the CMSIS-DAP commands are implemented. ***/
   /*
    * Command numbers 0x80 and above are vendor extensions, EDBG Payload uses 0x80 and x81.
    * Additionally, 0x82 is reserved for device event notification.
+   *
+   * Executes one DAP command from _req and writes its response to _res,
+   * which may be the same buffer. Every request field is read before the
+   * response overwrites it. Returns the length of the response.
    */
-  bool dap_command_check (void) {
-    bool _result = false;
-    uint8_t _cmd = EP_MEM.dap_data[0];
-    uint8_t _sub = EP_MEM.dap_data[1];
+  uint8_t dap_command (uint8_t* _req, uint8_t* _res, bool &_result) {
+    uint8_t _cmd = _req[0];
+    uint8_t _sub = _req[1];
+    uint8_t _rsplen = 2;
     D2PRINTF("DAP=%02X SUB=%02X\r\n", _cmd, _sub);
     DFLUSH();
-    USB::ep_dpi_pending();
+    _res[0] = _cmd;
 
     /*** EDBG Payload ***/
     /*
@@ -71,19 +81,19 @@ namespace JTAG {
     if (_cmd == 0x80) {             /* DAP_EDBG_VENDOR_AVR_CMD */
       uint8_t _endf = _sub & 0x0F;
       uint8_t _frag = _sub >> 4;
-      uint8_t _size = EP_MEM.dap_data[3];
+      uint8_t _size = _req[3];
       size_t  _ofst = (_frag - 1) * 60;
       if (_endf >= 10) {
         /* Only a maximum of 540 bytes : 9 fragment records is accepted. */
-        EP_MEM.dap_data[1] = 0x00;  /* EDBG_RSP_FAIL */
+        _res[1] = 0x00;             /* EDBG_RSP_FAIL */
       }
       else {
         /* Detect the first chunk. */
         if (_frag == 1) _packet_chunks = 0;
         ++_packet_chunks;
-        memcpy(&packet.rawData[_ofst], &EP_MEM.dap_data[4], _size);
-        EP_MEM.dap_data[1] = 0x01;  /* EDBG_RSP_OK */
-        D3PRINTHEX(&EP_MEM.dap_data, _size + 4);
+        memcpy(&packet.rawData[_ofst], &_req[4], _size);
+        _res[1] = 0x01;             /* EDBG_RSP_OK */
+        D3PRINTHEX(_req, _size + 4);
         if (_endf == _frag) {       /* end of defragment */
           _packet_length = _ofst + _size;
           D3PRINTF(" SQ=%03X:%03X<", packet.out.sequence, _packet_length);
@@ -95,72 +105,159 @@ namespace JTAG {
           }
           else {
             /* A missing chunk is detected, so an error is returned. */
-            EP_MEM.dap_data[1] = 0x00;  /* EDBG_RSP_FAIL */
+            _res[1] = 0x00;         /* EDBG_RSP_FAIL */
           }
         }
       }
     }
     else if (_cmd == 0x81) {        /* DAP_EDBG_VENDOR_AVR_RSP */
-      EP_MEM.dap_data[2] = 0;       /* Always zero */
+      _res[2] = 0;                  /* Always zero */
+      _rsplen = 4;
       if (_packet_endfrag == 0) {
-        EP_MEM.dap_data[1] = 0;
-        EP_MEM.dap_data[3] = 0;
+        _res[1] = 0;
+        _res[3] = 0;
       }
       else {
-        memcpy(&EP_MEM.dap_data[4], &packet.in.token + (_packet_fragment * 60), 60);
-        EP_MEM.dap_data[1] = ((++_packet_fragment) << 4) | _packet_endfrag;
-        EP_MEM.dap_data[3] = _packet_fragment == _packet_endfrag ? _packet_length : 60;
+        uint8_t _size = dap_fragment_size();
+        memcpy(&_res[4], &packet.in.token + (_packet_fragment * 60), _size);
+        _res[1] = ((++_packet_fragment) << 4) | _packet_endfrag;
+        _res[3] = _size;
         _packet_length -= 60;
+        _rsplen = _size + 4;
         D3PRINTF(" PI=");
-        D3PRINTHEX(&EP_MEM.dap_data, EP_MEM.dap_data[3] + 4);
+        D3PRINTHEX(_res, _res[3] + 4);
       }
     }
 
     /*** DAP Standard ***/
     else if (_cmd == 0x00) {        /* DAP_CMD_INFO */
+      _res[1] = 0x00;               /* length=0 : not supported */
       if (_sub == 0xFF              /* DAP_INFO_PACKET_SIZE      */
        || _sub == 0xFB              /* UART Receive Buffer Size  */
        || _sub == 0xFC) {           /* UART Transmit Buffer Size */
-        EP_MEM.dap_data[1] = 0x02;  /* length=2 */
-        EP_MEM.dap_data[2] = 0x40;  /* MaxPacketSize = 64 */
-        EP_MEM.dap_data[3] = 0x00;
+        _res[1] = 0x02;             /* length=2 */
+        _res[2] = 0x40;             /* MaxPacketSize = 64 */
+        _res[3] = 0x00;
+        _rsplen = 4;
         D3PRINTF(" PI=");
-        D3PRINTHEX(&EP_MEM.dap_data, 4);
+        D3PRINTHEX(_res, 4);
       }
       else if (_sub == 0xF1) {      /* DAP_INFO_Capabilities */
-        EP_MEM.dap_data[1] = 0x02;  /* length=2 */
-        EP_MEM.dap_data[2] = 0x00;  /* 7:UART Communication Port */
-        EP_MEM.dap_data[3] = 0x00;  /* 0:USB COM Port */
+        _res[1] = 0x02;             /* length=2 */
+        _res[2] = 0x00;             /* 7:UART Communication Port */
+        _res[3] = 0x00;             /* 0:USB COM Port */
+        _rsplen = 4;
         D3PRINTF(" PI=");
-        D3PRINTHEX(&EP_MEM.dap_data, 4);
+        D3PRINTHEX(_res, 4);
       }
     }
     else if (_cmd == 0x02) {        /* DAP_CMD_CONNECT */
-      /* EP_MEM.dap_data[1] == CONN_TYPE */
+      /* _req[1] == CONN_TYPE */
       /* Here, the response is returned without processing. */
+      _res[1] = _sub;
       D3PRINTF(" PI=");
-      D3PRINTHEX(&EP_MEM.dap_data, 2);
+      D3PRINTHEX(_res, 2);
     }
-    else if (_cmd == 0x01           /* DAP_CMD_HOSTSTATUS */
-          && _sub == 0x00) {        /* DAP_LED_CONNECT */
-      /* EP_MEM.dap_data[2] == LED_ON/OFF */
+    else if (_cmd == 0x01) {        /* DAP_CMD_HOSTSTATUS */
+      /* _req[2] == LED_ON/OFF */
       /* Here, the response is returned without processing. */
-      _led_next = 0b11111111;
-      // TCA0_SINGLE_PER = F_CPU / 1024 / 20;
+      if (_sub == 0x00) {           /* DAP_LED_CONNECT */
+        _led_next = 0b11111111;
+        // TCA0_SINGLE_PER = F_CPU / 1024 / 20;
+      }
+      _res[1] = 0x00;
       D3PRINTF(" PI=");
-      D3PRINTHEX(&EP_MEM.dap_data, 3);
+      D3PRINTHEX(_res, 2);
     }
     else if (_cmd == 0x03) {        /* DAP_CMD_DISCONNECT */
       /* Here, the response is returned without processing. */
+      _res[1] = 0x00;
       D3PRINTF(" PI=");
-      D3PRINTHEX(&EP_MEM.dap_data, 2);
+      D3PRINTHEX(_res, 2);
+      NVM::V4::row_commit();
       loop_until_bit_is_clear(WDT_STATUS, WDT_SYNCBUSY_bp);
       _PROTECTED_WRITE(WDT_CTRLA, WDT_PERIOD_128CLK_gc);
       GPCONF = GPCONF_FAIL_bm;
     }
     else {
-      EP_MEM.dap_data[1] = 0x00;    /* other 0 length result */
+      _res[1] = 0x00;               /* other 0 length result */
     }
+    return _rsplen;
+  }
+
+#if defined(CONFIG_DAP_QUEUE)
+
+  /* Length of a DAP request, or 0 if it cannot be stepped over. */
+  uint8_t dap_request_length (const uint8_t* _req) {
+    uint8_t _cmd = _req[0];
+    if (_cmd == 0x80) return _req[3] + 4;
+    if (_cmd == 0x81 || _cmd == 0x03) return 1;
+    if (_cmd == 0x00 || _cmd == 0x02) return 2;
+    if (_cmd == 0x01) return 3;
+    return 0;
+  }
+
+  /*
+   * DAP_QueueCommands (0x7E) and DAP_ExecuteCommands (0x7F) carry
+   * several DAP commands in one report and return one combined answer:
+   *
+   *   Request  : [0x7E/0x7F] [NUM] [command] ...
+   *   Response : [0x7E/0x7F] [NUM] [response] ...
+   *
+   * The request is copied to dap_queue first, because the responses are
+   * written back into dap_data. Commands are executed while the responses
+   * fit into the 64-byte report; the returned NUM tells the host how many
+   * were done. A payload completed by 0x80 is processed immediately, so
+   * that a following 0x81 in the same report already returns its answer
+   * if its final fragment fits in the rest of the report, as a status or
+   * a short read does. Otherwise the queue stops before that 0x81, and the
+   * host reads the response with plain 0x81 reports.
+   *
+   * Only one report can be buffered here, so a queued report is answered
+   * at once, exactly like DAP_ExecuteCommands.
+   */
+  void dap_execute_commands (bool &_result) {
+    uint8_t* _req = &EP_MEM.dap_queue[2];
+    uint8_t* _res = &EP_MEM.dap_data[2];
+    uint8_t  _num = EP_MEM.dap_data[1];
+    uint8_t  _done = 0;
+    memcpy(&EP_MEM.dap_queue[0], &EP_MEM.dap_data[0], sizeof(EP_MEM.dap_queue));
+    while (_done < _num) {
+      uint8_t _len = dap_request_length(_req);
+      if (_len == 0 || _req + _len > &EP_MEM.dap_queue[sizeof(EP_MEM.dap_queue)]) break;
+      uint8_t _room = 4;
+      if (_req[0] == 0x81) _room += dap_fragment_size();
+      if (_res + _room > &EP_MEM.dap_data[sizeof(EP_MEM.dap_data)]) break;
+      _res += dap_command(_req, _res, _result);
+      _req += _len;
+      _done++;
+      if (_result) {
+        jtag_scope_branch();
+#if defined(CONFIG_NVM_BACKGROUND)
+        /* A following 0x81 in this report needs the response now. */
+        if (NVM::V4::job_busy()) {
+          size_t _rspsize;
+          do _rspsize = NVM::V4::job_step(); while (NVM::V4::job_busy());
+          jtag_scope_complete(_rspsize);
+        }
+#endif
+        _result = false;
+      }
+    }
+    EP_MEM.dap_data[1] = _done;
+  }
+
+#endif
+
+  bool dap_command_check (void) {
+    bool _result = false;
+    USB::ep_dpi_pending();
+#if defined(CONFIG_DAP_QUEUE)
+    uint8_t _cmd = EP_MEM.dap_data[0];
+    if (_cmd == 0x7E || _cmd == 0x7F) dap_execute_commands(_result);
+    else
+#endif
+    dap_command(&EP_MEM.dap_data[0], &EP_MEM.dap_data[0], _result);
     USB::complete_dap_out();
     return _result; /* True if an EDBG Payload is received. */
   }
@@ -182,150 +279,361 @@ namespace JTAG {
     D3PRINTHEX(&packet.in.token, _packet_length);
   }
 
+  /*** Table driven command dispatch. ***/
+  /*
+   * Scans a PROGMEM dispatch table for the given code and calls its handler.
+   * The table is terminated by code 0xFF, whose handler serves as the default.
+   * Each record is 3 bytes of PROGMEM, and the longest table has about ten
+   * records, so a linear scan is used instead of a full scope x cmd matrix.
+   */
+  size_t dispatch (const JTAG_Dispatch_t* _table, uint8_t _code) {
+    uint8_t _key;
+    while ((_key = pgm_read_byte(&_table->code)) != _code && _key != 0xFF) _table++;
+    JTAG_Handler_t _handler = (JTAG_Handler_t)pgm_read_word(&_table->handler);
+    return _handler ? _handler() : 0;
+  }
+
   /*** Only a subset of JTAGICE3 commands are implemented. ***/
-  size_t jtag_scope_general (void) {
-    size_t  _rspsize = 0;
-    uint8_t _cmd     = packet.out.cmd;
+  size_t general_get_parameter (void) {
     uint8_t _section = packet.out.section;
     uint8_t _index   = packet.out.index;
     uint8_t _length  = packet.out.length;
-    if (_cmd == 0x02) {             /* CMD3_GET_PARAMETER */
-      // D1PRINTF(" GEN_GET_PARAM=%02X:%02X:%02X\r\n", _section, _index, _length);
-      if (_section == 0) {          /* SET_GET_CTXT_CONFIG */
-        /* _index == 0-5 */
-        memcpy_P(&packet.in.data[0], &jtag_version[_index], _length);
-        D1PRINTF(" VER=");
-        D1PRINTHEX(&packet.in.data[0], _length);
-      }
-      else if (_section == 1) {     /* SET_GET_CTXT_PHYSICAL */
-        if (_index == 0 || _index == 0x20) {  /* PARM3_VTARGET */
-          packet.in.wValue = SYS::get_vdd();
-          D1PRINTF(" VTG=%d\r\n", packet.in.wValue);
-        }
-      }
-      packet.in.res = 0x184;        /* RSP3_DATA */
-      _rspsize = _length + 1;
+    // D1PRINTF(" GEN_GET_PARAM=%02X:%02X:%02X\r\n", _section, _index, _length);
+    if (_section == 0) {            /* SET_GET_CTXT_CONFIG */
+      /* _index == 0-5 */
+      memcpy_P(&packet.in.data[0], &jtag_version[_index], _length);
+      D1PRINTF(" VER=");
+      D1PRINTHEX(&packet.in.data[0], _length);
     }
-    else if (_cmd == 0x10) {        /* CMD3_SIGN_ON */
-      D1PRINTF(" GEN_SIGN_ON\r\n");
-      _jtag_arch = 0;
-      packet.in.res = 0x80;         /* RSP3_OK */
-    }
-    else if (_cmd == 0x11) {        /* CMD3_SIGN_OFF */
-      D1PRINTF(" GEN_SIGN_OFF\r\n");
-      packet.in.res = 0x80;         /* RSP3_OK */
+    else if (_section == 1) {       /* SET_GET_CTXT_PHYSICAL */
+      if (_index == 0 || _index == 0x20) {  /* PARM3_VTARGET */
+        packet.in.wValue = SYS::get_vdd();
+        D1PRINTF(" VTG=%d\r\n", packet.in.wValue);
+      }
     }
-    return _rspsize;
+    packet.in.res = 0x184;          /* RSP3_DATA */
+    return _length + 1;
+  }
+
+  size_t general_sign_on (void) {
+    D1PRINTF(" GEN_SIGN_ON\r\n");
+    _jtag_arch = 0;
+#if defined(CONFIG_JTAG_REPLAY)
+    _last_cmd = 0;
+#endif
+    packet.in.res = 0x80;           /* RSP3_OK */
+    return 0;
+  }
+
+  size_t general_sign_off (void) {
+    D1PRINTF(" GEN_SIGN_OFF\r\n");
+    NVM::V4::row_commit();
+    packet.in.res = 0x80;           /* RSP3_OK */
+    return 0;
   }
 
   /*** The EDBG scope provides access to the writer's hardware specifications. ***/
   /* There is no impact on operation if it is not called at all. */
-  size_t jtag_scope_edbg (void) {
-    size_t  _rspsize = 0;
-    uint8_t _cmd     = packet.out.cmd;
-    uint8_t _length  = packet.out.length;
-    if (_cmd == 0x01) {             /* CMD3_SET_PARAMETER */
-      packet.in.res = 0x80;         /* RSP3_OK */
-    }
-    else if (_cmd == 0x02) {        /* CMD3_GET_PARAMETER */
-      packet.in.res = 0x184;        /* RSP3_DATA */
-      _rspsize = _length + 1;
+  size_t edbg_set_parameter (void) {
+    packet.in.res = 0x80;           /* RSP3_OK */
+    return 0;
+  }
+
+  size_t edbg_get_parameter (void) {
+    uint8_t _index  = packet.out.index;
+    uint8_t _length = packet.out.length;
+    if (packet.out.section == 0x80   /* euboot diagnostics */
+     && _index + _length <= sizeof(_diag)) {
+      memcpy(&packet.in.data[0], (uint8_t*)&_diag + _index, _length);
     }
-    return _rspsize;
+    packet.in.res = 0x184;          /* RSP3_DATA */
+    return _length + 1;
   }
 
   /* The AVR scope is further branched by the ARCH designator. */
-  size_t jtag_scope_avr_core (void) {
-    size_t  _rspsize = 0;
-    uint8_t _cmd     = packet.out.cmd;
+  size_t avr_set_parameter (void) {
     uint8_t _section = packet.out.section;
     uint8_t _index   = packet.out.index;
     uint8_t _length  = packet.out.length;
-    if (_cmd == 0x01) {             /* CMD3_SET_PARAMETER */
-      uint16_t _data = packet.out.wValue & 0xFF;
-      if (_section == 0) {          /* SET_GET_CTXT_CONFIG */
-        if (_index == 0) {          /* PARM3_ARCH */
-          D1PRINTF(" ARCH=%02X\r\n", _data);
-          _jtag_arch = _data;       /* 5:UPDI 3:PDI */
-        }
+    uint16_t _data   = packet.out.wValue & 0xFF;
+    if (_section == 0) {            /* SET_GET_CTXT_CONFIG */
+      if (_index == 0) {            /* PARM3_ARCH */
+        D1PRINTF(" ARCH=%02X\r\n", _data);
+        _jtag_arch = _data;         /* 5:UPDI 3:PDI */
       }
-      else if (_section == 1) {     /* SET_GET_CTXT_PHYSICAL */
-        if (_index == 0) {          /* PARM3_CONNECTION */
-          D1PRINTF(" CONNECTION=%02X\r\n", _data);
-          _jtag_conn = _data;       /* 8:PARM3_CONN_UPDI */
-        }
+    }
+    else if (_section == 1) {       /* SET_GET_CTXT_PHYSICAL */
+      if (_index == 0) {            /* PARM3_CONNECTION */
+        D1PRINTF(" CONNECTION=%02X\r\n", _data);
+        _jtag_conn = _data;         /* 8:PARM3_CONN_UPDI */
       }
-      else if (_section == 2) {     /* SET_GET_CTXT_DEVICE */
-        if (_index == 0) {          /* PARM3_DEVICEDESC */
-          D1PRINTF(" DEVICEDESC=%X\r\n", _length);
-          memcpy(&Device_Descriptor, &packet.out.setData[0], _length & 63);
+    }
+    else if (_section == 2) {       /* SET_GET_CTXT_DEVICE */
+      if (_index == 0) {            /* PARM3_DEVICEDESC */
+        D1PRINTF(" DEVICEDESC=%X\r\n", _length);
   #if DEBUG >= 1
-          if (_jtag_arch == 5) {
-            D2PRINTF("(UPDI)  prog_base=%02X:%04X\r\n", Device_Descriptor.UPDI.prog_base_msb, Device_Descriptor.UPDI.prog_base);
-            D2PRINTF("  flash_page_size=%02X:%02X\r\n", Device_Descriptor.UPDI.flash_page_size_msb, Device_Descriptor.UPDI.flash_page_size);
-            D2PRINTF("      flash_bytes=%06lX\r\n", Device_Descriptor.UPDI.flash_bytes);
-            D2PRINTF("     eeprom_bytes=%04X\r\n", Device_Descriptor.UPDI.eeprom_bytes);
-            D2PRINTF("   user_sig_bytes=%04X\r\n", Device_Descriptor.UPDI.user_sig_bytes);
-            D2PRINTF("      fuses_bytes=%04X\r\n", Device_Descriptor.UPDI.fuses_bytes);
-            D2PRINTF("      eeprom_base=%04X\r\n", Device_Descriptor.UPDI.eeprom_base);
-            D2PRINTF("    user_sig_base=%04X\r\n", Device_Descriptor.UPDI.user_sig_base);
-            D2PRINTF("   signature_base=%04X\r\n", Device_Descriptor.UPDI.signature_base);
-            D2PRINTF("       fuses_base=%04X\r\n", Device_Descriptor.UPDI.fuses_base);
-            D2PRINTF("    lockbits_base=%04X\r\n", Device_Descriptor.UPDI.lockbits_base);
-            D2PRINTF("     address_mode=%02X\r\n", Device_Descriptor.UPDI.address_mode);
-            D2PRINTF("   hvupdi_variant=%02X\r\n", Device_Descriptor.UPDI.hvupdi_variant);
-            /* Even with all this, the BOOTROW information is still undefined! */
-            /* Re-analysis of newer ICE FW is needed! */
-          }
-          /* STUB: And other descriptors. */
-  #endif
+        /* The descriptor is not kept; it is only viewed in place. */
+        Device_Desc_t& Device_Descriptor = *(Device_Desc_t*)&packet.out.setData[0];
+        if (_jtag_arch == 5) {
+          D2PRINTF("(UPDI)  prog_base=%02X:%04X\r\n", Device_Descriptor.UPDI.prog_base_msb, Device_Descriptor.UPDI.prog_base);
+          D2PRINTF("  flash_page_size=%02X:%02X\r\n", Device_Descriptor.UPDI.flash_page_size_msb, Device_Descriptor.UPDI.flash_page_size);
+          D2PRINTF("      flash_bytes=%06lX\r\n", Device_Descriptor.UPDI.flash_bytes);
+          D2PRINTF("     eeprom_bytes=%04X\r\n", Device_Descriptor.UPDI.eeprom_bytes);
+          D2PRINTF("   user_sig_bytes=%04X\r\n", Device_Descriptor.UPDI.user_sig_bytes);
+          D2PRINTF("      fuses_bytes=%04X\r\n", Device_Descriptor.UPDI.fuses_bytes);
+          D2PRINTF("      eeprom_base=%04X\r\n", Device_Descriptor.UPDI.eeprom_base);
+          D2PRINTF("    user_sig_base=%04X\r\n", Device_Descriptor.UPDI.user_sig_base);
+          D2PRINTF("   signature_base=%04X\r\n", Device_Descriptor.UPDI.signature_base);
+          D2PRINTF("       fuses_base=%04X\r\n", Device_Descriptor.UPDI.fuses_base);
+          D2PRINTF("    lockbits_base=%04X\r\n", Device_Descriptor.UPDI.lockbits_base);
+          D2PRINTF("     address_mode=%02X\r\n", Device_Descriptor.UPDI.address_mode);
+          D2PRINTF("   hvupdi_variant=%02X\r\n", Device_Descriptor.UPDI.hvupdi_variant);
+          /* Even with all this, the BOOTROW information is still undefined! */
+          /* Re-analysis of newer ICE FW is needed! */
         }
+        /* STUB: And other descriptors. */
+  #endif
       }
-      packet.in.res = 0x80;         /* RSP3_OK */
     }
-    else if (_cmd == 0x02) {        /* CMD3_GET_PARAMETER */
-      if (_section == 0) {          /* SET_GET_CTXT_CONFIG */
-        if (_index == 0) {          /* PARM3_ARCH */
-          packet.in.data[0] = _jtag_arch;
-        }
+    packet.in.res = 0x80;           /* RSP3_OK */
+    return 0;
+  }
+
+  size_t avr_get_parameter (void) {
+    uint8_t _section = packet.out.section;
+    uint8_t _index   = packet.out.index;
+    if (_section == 0) {            /* SET_GET_CTXT_CONFIG */
+      if (_index == 0) {            /* PARM3_ARCH */
+        packet.in.data[0] = _jtag_arch;
       }
-      else if (_section == 1) {     /* SET_GET_CTXT_PHYSICAL */
-        if (_index == 0) {          /* PARM3_CONNECTION */
-          /* This is a stub that is called but not used. */
-          packet.in.data[0] = _jtag_conn;
-        }
-        else if (_index == 0x31) {  /* PARM3_CLK_XMEGA_PDI */
-          D1PRINTF(" BOOT=%d\r\n", _bootsize);
-          packet.in.wValue = _bootsize;
-        }
+    }
+    else if (_section == 1) {       /* SET_GET_CTXT_PHYSICAL */
+      if (_index == 0) {            /* PARM3_CONNECTION */
+        /* This is a stub that is called but not used. */
+        packet.in.data[0] = _jtag_conn;
+      }
+      else if (_index == 0x31) {    /* PARM3_CLK_XMEGA_PDI */
+        D1PRINTF(" BOOT=%d\r\n", _bootsize);
+        packet.in.wValue = _bootsize;
       }
-      packet.in.res = 0x184;        /* RSP3_DATA */
-      _rspsize = _length + 1;
     }
+    packet.in.res = 0x184;          /* RSP3_DATA */
+    return packet.out.length + 1;
+  }
+
+  size_t avr_arch_branch (void) {
     /* AVR-DU series support */
-    else if (_jtag_arch == 0x05) _rspsize = NVM::V4::jtag_scope_updi();
-    else packet.in.res = 0xA0;      /* RSP3_FAILED */
-    return _rspsize;
-  } /* jtag_scope_avr_core */
+    if (_jtag_arch == 0x05) return NVM::V4::jtag_scope_updi();
+    packet.in.res = 0xA0;           /* RSP3_FAILED */
+    return 0;
+  }
+
+#if defined(CONFIG_JTAG_BATCH)
+
+  /*** Vendor extension: batch of AVR scope commands ***/
+  /*
+   * Executes several AVR scope commands carried in one EDBG payload and
+   * returns all results packed into one RSP3_DATA response.
+   *
+   *   Request  : [reserved] { [LEN] [CMD] [DATA x (LEN - 1)] } ... [0]
+   *   Response : { [RSP] [SIZE] [DATA x SIZE] } ...
+   *
+   * DATA is what the command would carry after its CMD byte, and is
+   * executed by the regular AVR scope dispatch. RSP is the low byte of
+   * the command's response code. Only the commands in batch_allowed(),
+   * which never write NVM or start an NVM job, are executed. The others
+   * report RSP3_FAILED, as does a read that would not fit. Should a job
+   * still be started, it is run to its end before the next command, so
+   * it never outlives the batch and overwrites its response.
+   *
+   * The list is moved to the tail of the packet buffer, clear of the
+   * response area, and results are collected in work_data, which shares
+   * the workspace with the EP0 response buffer.
+   */
+  size_t jtag_scope_avr_core (void);
+
+  bool batch_allowed (uint8_t _cmd) {
+    return _cmd == 0x01             /* CMD3_SET_PARAMETER */
+        || _cmd == 0x02             /* CMD3_GET_PARAMETER */
+        || _cmd == 0x10             /* CMD3_SIGN_ON */
+        || _cmd == 0x15             /* CMD3_ENTER_PROGMODE */
+        || _cmd == 0x21;            /* CMD3_READ_MEMORY */
+  }
+
+  size_t avr_batch (void) {
+    size_t _size = _packet_length - 7;
+    if (_packet_length < 7 || _size > sizeof(packet.rawData) - 7 - sizeof(EP_MEM.work_data)) {
+      packet.in.res = 0xA0;         /* RSP3_FAILED */
+      return 0;
+    }
+    uint8_t* _list = &packet.rawData[sizeof(packet.rawData) - _size];
+    uint8_t* _rsp  = &EP_MEM.work_data[0];
+    uint8_t* _end  = _rsp + sizeof(EP_MEM.work_data);
+    memmove(_list, &packet.out.data[1], _size);
+    while (_size) {
+      uint8_t _len = *_list++;
+      if (_len == 0 || _len >= _size) break;
+      /* The command must not overlap the list when it is unpacked. */
+      if (&packet.out.data[_len] > _list) break;
+      _size -= _len + 1;
+      uint8_t _cmd = *_list;
+      packet.out.cmd = _cmd;
+      memcpy(&packet.out.data[0], _list + 1, _len - 1);
+      _list += _len;
+      size_t _rspsize = 0;
+      if (batch_allowed(_cmd)
+       && (_cmd != 0x21 || packet.out.dwLength + 2 <= (size_t)(_end - _rsp))) {
+        _rspsize = jtag_scope_avr_core();
+        while (NVM::V4::job_busy()) _rspsize = NVM::V4::job_step();
+      }
+      else packet.in.res = 0xA0;    /* RSP3_FAILED */
+      if (_rspsize) _rspsize--;
+      if (_rsp + 2 + _rspsize > _end) {
+        packet.in.res = 0xA0;       /* RSP3_FAILED */
+        return 0;
+      }
+      *_rsp++ = (uint8_t)packet.in.res;
+      *_rsp++ = _rspsize;
+      memcpy(_rsp, &packet.in.data[0], _rspsize);
+      _rsp += _rspsize;
+    }
+    _size = _rsp - &EP_MEM.work_data[0];
+    memcpy(&packet.in.data[0], &EP_MEM.work_data[0], _size);
+    packet.in.res = 0x184;          /* RSP3_DATA */
+    return _size + 1;
+  }
+
+#endif
+
+#if defined(CONFIG_SYS_SLOTS)
+
+  /*
+   * CMD3_VENDOR_SLOT (0xE1)
+   *
+   *   Request  : [reserved] [SLOT]
+   *   Response : [ACTIVE] [PAGES] [START_L] [START_H]
+   *
+   * SLOT 0 or 1 selects the slot that starts next; any other value only
+   * queries. ACTIVE is the selected slot, PAGES the size of a slot, and
+   * START the address of the other slot, which is where uploads go.
+   * Selecting an erased slot fails with RSP3_FAILED.
+   */
+  size_t avr_slot (void) {
+    uint8_t _slot = packet.out.data[1];
+    if (_slot <= 1 && !NVM::V4::select_slot(_slot)) {
+      packet.in.res = 0xA0;         /* RSP3_FAILED */
+      return 0;
+    }
+    uint16_t _start = NVM::V4::slot_start(_active_slot ^ 1);
+    packet.in.data[0] = _active_slot;
+    packet.in.data[1] = NVM::V4::slot_pages();
+    packet.in.data[2] = (uint8_t)_start;
+    packet.in.data[3] = _start >> 8;
+    packet.in.res = 0x184;          /* RSP3_DATA */
+    return 5;
+  }
+
+#endif
+
+  // MARK: Dispatch tables
+
+  /* To register a new command, add a record before the terminator. */
+
+  constexpr JTAG_Dispatch_t PROGMEM general_table[] = {
+    { 0x02, &general_get_parameter }, /* CMD3_GET_PARAMETER */
+    { 0x10, &general_sign_on       }, /* CMD3_SIGN_ON */
+    { 0x11, &general_sign_off      }, /* CMD3_SIGN_OFF */
+    { 0xFF, nullptr                }
+  };
+  static_assert(jtag_dispatch_valid(general_table), "general_table");
+
+  constexpr JTAG_Dispatch_t PROGMEM edbg_table[] = {
+    { 0x01, &edbg_set_parameter    }, /* CMD3_SET_PARAMETER */
+    { 0x02, &edbg_get_parameter    }, /* CMD3_GET_PARAMETER */
+    { 0xFF, nullptr                }
+  };
+  static_assert(jtag_dispatch_valid(edbg_table), "edbg_table");
+
+  constexpr JTAG_Dispatch_t PROGMEM avr_table[] = {
+    { 0x01, &avr_set_parameter     }, /* CMD3_SET_PARAMETER */
+    { 0x02, &avr_get_parameter     }, /* CMD3_GET_PARAMETER */
+  #if defined(CONFIG_JTAG_BATCH)
+    { 0xE0, &avr_batch             }, /* CMD3_VENDOR_BATCH (euboot) */
+  #endif
+  #if defined(CONFIG_SYS_SLOTS)
+    { 0xE1, &avr_slot              }, /* CMD3_VENDOR_SLOT (euboot) */
+  #endif
+    { 0xFF, &avr_arch_branch       }  /* Others depend on ARCH */
+  };
+  static_assert(jtag_dispatch_valid(avr_table), "avr_table");
+
+  size_t jtag_scope_general (void) { return dispatch(general_table, packet.out.cmd); }
+  size_t jtag_scope_edbg (void) { return dispatch(edbg_table, packet.out.cmd); }
+  size_t jtag_scope_avr_core (void) { return dispatch(avr_table, packet.out.cmd); }
 
   /* Processing branches depending on the scope specifier. */
   /* Currently, four types of scope are known: */
+  constexpr JTAG_Dispatch_t PROGMEM scope_table[] = {
+    { 0x01, &jtag_scope_general    }, /* SCOPE_GENERAL */
+    { 0x12, &jtag_scope_avr_core   }, /* SCOPE_AVR */
+    { 0x20, &jtag_scope_edbg       }, /* SCOPE_EDBG */
+    { 0xFF, nullptr                }
+  };
+  static_assert(jtag_dispatch_valid(scope_table), "scope_table");
+
+  /*
+   * A host that times out resends the command with the same sequence number.
+   * With CONFIG_JTAG_REPLAY, commands that change NVM are not executed
+   * again: their response is only a status, which is kept and replayed.
+   * Other commands have no side effects and are simply executed again.
+   */
   void jtag_scope_branch (void) {
-    size_t _rspsize = 0;
-    uint8_t _scope  = packet.out.scope;
+    size_t   _rspsize;
+    uint8_t  _scope    = packet.out.scope;
+    uint8_t  _cmd      = packet.out.cmd;
     D2PRINTF("SQ=%d:%d>SCOPE=%02X,C=%02X,S=%02X,L=%02X\r\n",
       packet.out.sequence,
       _packet_length,
       _scope,
-      packet.out.cmd,
+      _cmd,
       packet.out.section,
       packet.out.index);
-    if      (_scope == 0x01) _rspsize = jtag_scope_general();       /* SCOPE_GENERAL */
-    else if (_scope == 0x12) _rspsize = jtag_scope_avr_core();      /* SCOPE_AVR */
-    else if (_scope == 0x20) _rspsize = jtag_scope_edbg();          /* SCOPE_EDBG */
-    complete_jtag_transactions(_rspsize);
+#if defined(CONFIG_JTAG_REPLAY)
+    uint16_t _sequence = packet.out.sequence;
+    bool _nvm = _scope == 0x12 && (_cmd == 0x20 || _cmd == 0x23 || _cmd == 0xE2 || _cmd == 0xE3);
+    if (_sequence == _last_sequence) _diag.retransmits++;
+    if (_nvm && _cmd == _last_cmd && _sequence == _last_sequence) {
+      D1PRINTF(" REPLAY=%d\r\n", _sequence);
+      _diag.replays++;
+      packet.in.res = _last_res;
+      _rspsize = _last_rspsize;
+    }
+    else {
+      _rspsize = dispatch(scope_table, _scope);
+      _last_cmd = _nvm ? _cmd : 0;
+    }
+    _last_sequence = _sequence;
+#else
+    _rspsize = dispatch(scope_table, _scope);
+#endif
+#if defined(CONFIG_NVM_BACKGROUND)
+    /* The main loop steps the job and publishes its response. */
+    if (NVM::V4::job_busy()) return;
+#else
+    while (NVM::V4::job_busy()) _rspsize = NVM::V4::job_step();
+#endif
+    jtag_scope_complete(_rspsize);
   } /* jtag_scope_branch */
 
+  /*** Publish the response, and keep it for a retransmitted NVM command. ***/
+  void jtag_scope_complete (size_t _rspsize) {
+#if defined(CONFIG_JTAG_REPLAY)
+    _last_res = packet.in.res;
+    _last_rspsize = _rspsize;
+#endif
+    complete_jtag_transactions(_rspsize);
+  }
+
 };
 
 // end of code
@@ -30,13 +30,13 @@
 
 namespace /* NAMELESS */ {
 
+  /* Workspace arena */
+  alignas(2) NOINIT Workspace_t _workspace;
+
   /* USB */
   alignas(2) NOINIT EP_TABLE_t EP_TABLE;
-  alignas(2) NOINIT EP_DATA_t EP_MEM;
-  NOINIT Device_Desc_t Device_Descriptor;
 
   /* JTAG packet payload */
-  NOINIT JTAG_Packet_t packet;
   NOINIT size_t  _packet_length;
   NOINIT uint8_t _packet_fragment;
   NOINIT uint8_t _packet_chunks;
@@ -46,9 +46,37 @@ namespace /* NAMELESS */ {
   NOINIT uint8_t _jtag_arch;
   NOINIT uint8_t _jtag_conn;
   NOINIT uint32_t _before_page;
+  NOINIT uint8_t _erased_page;
+  NOINIT uint8_t _erased_end;
+
+#if defined(CONFIG_JTAG_REPLAY)
+  /* JTAG response cache */
+  NOINIT uint16_t _last_sequence;
+  NOINIT uint16_t _last_res;
+  NOINIT uint8_t _last_cmd;
+  NOINIT uint8_t _last_rspsize;
+#endif
+  NOINIT Diag_t _diag;
+
+  /* NVM job */
+  NOINIT NVM_Job_t _nvm_job;
+
+#if defined(CONFIG_NVM_ROWCACHE)
+  NOINIT uint16_t _row_addr;
+#endif
+
+#if defined(CONFIG_NVM_CRCFOOTER)
+  NOINIT bool _flash_dirty;
+#endif
+
+#if defined(CONFIG_SYS_SLOTS)
+  NOINIT uint8_t _active_slot;
+#endif
 
   /* SYSTEM */
   NOINIT uint16_t _bootsize;
+  NOINIT uint16_t _vdd;
+  NOINIT bool _vdd_nvm;
   NOINIT uint8_t _set_config;
   NOINIT uint8_t _led_bits;
   NOINIT uint8_t _led_next;
@@ -56,6 +84,9 @@ namespace /* NAMELESS */ {
 
 } /* NAMELESS */;
 
+/* Leave at least 256 bytes of SRAM for the stack. */
+static_assert(sizeof(Workspace_t) + sizeof(EP_TABLE_t) + 256 <= DEVICE::Current::sram_size, "workspace exceeds SRAM");
+
 // MARK: Startup and Vectors Overload
 
 /* This section will be placed at the beginning of  */
@@ -65,12 +96,31 @@ namespace /* NAMELESS */ {
 __attribute__((used))
 int main (void);
 
+/*
+ * Everything up to $2D is a fixed ABI for applications.
+ * nvm_cmd is written here in assembly so that its address ($0E) and
+ * the service table after it do not depend on function placement.
+ * The word at $26 holds 0xE0 and the ABI version; each entry after it
+ * is an RJMP to a service in nvmv4.cpp. Version 0 has no entries.
+ */
+
 __attribute__((used))
+__attribute__((naked))
+__attribute__((noinline))
+__attribute__((noreturn))
 __attribute__((section (".vectors")))
-void nvm_cmd (uint8_t /* _nvm_cmd */) {
-  /* R24 <- _nvm_cmd */
+void vectors (void) {
   __asm__ __volatile__ (
     R"#ASM#(
+          RJMP  main              ; $0000
+          ST    Z+, R22           ; $0002 nvm_stz
+          RET
+          LD    R24, Z+           ; $0006 nvm_ldz
+          RET
+          SPM   Z+                ; $000A nvm_spm
+          RET
+          .global nvm_cmd         ; $000E nvm_cmd (R24 <- _nvm_cmd)
+      nvm_cmd:
       1:  LDS   R25, %0
           ANDI  R25, 3
           BRNE  1b
@@ -79,31 +129,39 @@ void nvm_cmd (uint8_t /* _nvm_cmd */) {
           STS   %1, __zero_reg__
           OUT   0x34, R25
           STS   %1, R24
+          RET
     )#ASM#"
-    :: "p" (_SFR_MEM_ADDR(NVMCTRL_STATUS))
-    ,  "p" (_SFR_MEM_ADDR(NVMCTRL_CTRLA))
-    : "r25"
-  );
-}
-
-__attribute__((used))
-__attribute__((naked))
-__attribute__((noinline))
-__attribute__((noreturn))
-__attribute__((section (".vectors")))
-void vectors (void) {
-  __asm__ __volatile__ (
+#if defined(CONFIG_USB_APPTABLE)
+    R"#ASM#(
+          .word 0xE002            ; $0026 ABI version 2
+    )#ASM#"
+#elif defined(CONFIG_NVM_PAGESERVICE)
+    R"#ASM#(
+          .word 0xE001            ; $0026 ABI version 1
+    )#ASM#"
+#else
+    R"#ASM#(
+          .word 0xE000            ; $0026 ABI version 0
+    )#ASM#"
+#endif
+#if defined(CONFIG_NVM_PAGESERVICE)
     R"#ASM#(
-      RJMP  main      ; $0000
-      ST    Z+, R22   ; $0002 nvm_stz
-      RET
-      LD    R24, Z+   ; $0006 nvm_ldz
-      RET
-      SPM   Z+        ; $000A nvm_spm
-      RET
+          RJMP  nvm_page_write    ; $0028
+          RJMP  nvm_page_erase    ; $002A
+          RJMP  nvm_page_update   ; $002C
     )#ASM#"
+#endif
+#if defined(CONFIG_USB_APPTABLE)
+    R"#ASM#(
+          RJMP  usb_app_setup     ; $002E
+          RJMP  usb_app_listen    ; $0030
+          RJMP  usb_app_pending   ; $0032
+          RJMP  usb_app_poll      ; $0034
+    )#ASM#"
+#endif
+    :: "p" (_SFR_MEM_ADDR(NVMCTRL_STATUS))
+    ,  "p" (_SFR_MEM_ADDR(NVMCTRL_CTRLA))
   );
-  /* next is nvm_cmd */
 }
 
 // MARK: main function
@@ -132,6 +190,9 @@ int main (void) {
   /* WDT restart causes user code to execute */
   if (bit_is_set(GPR_GPR0, RSTCTRL_WDRF_bp) || digitalReadMacro(PIN_SYS_SW0)) {
     pinControlRegister(PIN_SYS_SW0) = 0;
+#if defined(CONFIG_SYS_SLOTS)
+    _bootsize = NVM::V4::slot_start(NVM::V4::active_slot());
+#endif
     __asm__ __volatile__ ( "IJMP" :: "z" (_bootsize / 2) );
   }
 
@@ -159,6 +220,24 @@ int main (void) {
 
   _led_next = 0b11000000;
   _led_mask = 0;
+  _erased_page = _erased_end = 0;
+  _nvm_job.kind = 0;
+  _diag.retransmits = _diag.replays = 0;  /* VDD is set by setup_vdd() */
+#if defined(CONFIG_JTAG_REPLAY)
+  /* The host starts counting at 0, so the first command is never a resend. */
+  _last_sequence = 0xFFFF;
+  _last_cmd = 0;
+#endif
+#if defined(CONFIG_NVM_ROWCACHE)
+  _row_addr = 0;
+#endif
+#if defined(CONFIG_NVM_CRCFOOTER)
+  _flash_dirty = false;
+#endif
+#if defined(CONFIG_SYS_SLOTS)
+  NVM::V4::log_repair();
+  _active_slot = NVM::V4::active_slot();
+#endif
 
   TCA0_SINGLE_PER = F_CPU / 1024 / 12;
   TCA0_SINGLE_CTRLA = TCA_SINGLE_ENABLE_bm | TCA_SINGLE_CLKSEL_DIV1024_gc;
@@ -167,6 +246,7 @@ int main (void) {
   _PROTECTED_WRITE(WDT_CTRLA, WDT_PERIOD_1KCLK_gc);
 
   SYSCFG_VUSBCTRL = SYSCFG_USBVREG_bm;
+  SYS::setup_vdd();
 
   SYS::delay_125ms();
   SYS::delay_125ms();
@@ -179,6 +259,29 @@ int main (void) {
     DFLUSH();
     if (bit_is_clear(GPCONF, GPCONF_FAIL_bp)) wdt_reset();
 
+    bool _dap = bit_is_set(GPCONF, GPCONF_USB_bp);
+#if defined(CONFIG_NVM_BACKGROUND)
+    /* While an NVM job runs, DAP traffic waits for its response, */
+    /* and EP0 and bus events are served between the steps.       */
+    if (NVM::V4::job_busy()) {
+      size_t _rspsize = NVM::V4::job_step();
+      if (NVM::V4::job_busy()) _dap = false;
+      else JTAG::jtag_scope_complete(_rspsize);
+    }
+#endif
+
+    /* DAP traffic is tested first so that it is served with the least delay. */
+    if (_dap && !USB::is_not_dap()) {
+      if (JTAG::dap_command_check()) JTAG::jtag_scope_branch();
+      continue;
+    }
+
+    /* Bus flags and SETUP are only handled when they are set. */
+    if (USB::is_bus_event()) USB::handling_bus_events();
+    if (USB::is_ep_setup()) USB::handling_control_transactions();
+
+    /* VDD sampling and the LED pattern advance on the idle path only. */
+    SYS::update_vdd();
     if (bit_is_set(TCA0_SINGLE_INTFLAGS, TCA_SINGLE_CMP0_bp)) {
       bit_set(TCA0_SINGLE_INTFLAGS, TCA_SINGLE_CMP0_bp);
       if (_led_mask) _led_mask >>= 1;
@@ -188,15 +291,6 @@ int main (void) {
       }
       if (_led_bits & _led_mask) digitalWriteMacro(PIN_SYS_LED0, TOGGLE);
     }
-
-    USB::handling_bus_events();
-    if (USB::is_ep_setup()) USB::handling_control_transactions();
-
-    if (bit_is_clear(GPCONF, GPCONF_USB_bp)) continue;
-
-    if (USB::is_not_dap()) continue;
-
-    if (JTAG::dap_command_check()) JTAG::jtag_scope_branch();
   }
 }
 
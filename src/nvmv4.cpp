@@ -18,6 +18,8 @@
 
 #include <avr/io.h>
 #include <avr/pgmspace.h>   /* PROGMEM memcpy_P */
+#include <avr/wdt.h>        /* wdt_reset */
+#include <string.h>         /* memcpy memmove */
 #include "api/capsule.h"    /* _CAPS macro */
 #include "peripheral.h"     /* import Serial (Debug) */
 #include "configuration.h"
@@ -47,28 +49,132 @@
  * - Flash can be written in units of 512 bytes.
  *
  * - Erasing and rewriting a flash memory page are separate commands.
+ *   Up to 32 aligned pages can be erased at once with FLMPERn.
  *
  * - A page erase is required because USERROW is written to in the same way as flash.
  *
  * - BOOTROW can be treated the same as USERROW. It is a single page,
  *   so it must be erased before it can be rewritten.
+ *
+ * - A write shorter than a page is merged with the current page contents
+ *   before the erase, so the host can send only the bytes it wants to change.
  */
 
+static_assert(sizeof(packet.out.memData) >= PROGMEM_PAGE_SIZE, "memData must hold a whole flash page");
+static_assert(NVMCTRL_CMD_FLMPER32_gc - NVMCTRL_CMD_FLPER_gc == 5, "FLPER..FLMPER32 must be consecutive");
+
 namespace NVM::V4 {
 
   /* The bootloader implementation cannot read the SIB area */
   /* of ​​the UPDI, so it always returns a fixed value.       */
   const uint8_t PROGMEM _sib[] = "AVR     P:4D:1-3M2 (EDBG.Boot.)"; /* 31 + 1 bytes */
 
+  /* NVM job kinds (_nvm_job.kind) */
+  enum { JOB_NONE = 0, JOB_ERASE, JOB_FILL, JOB_COPY, JOB_FOOTER, JOB_JOURNAL };
+
   // MARK: API
 
   /* RAMPZ is not used because the flash memory of the AVR-DU series is a   */
   /* maximum of 64KiB, so pointers in the code area are limited to 16 bits. */
 
+  /*
+   * USERROW and BOOTROW writes are merged into the row cache, and the row
+   * is erased and written only once, by row_commit().
+   */
+  size_t page_size (uint8_t m_type, uint16_t _dwAddr);
+  size_t rsp3_status (size_t _rspsize);
+
+  void row_commit (void) {
+#if defined(CONFIG_NVM_ROWCACHE)
+    uint16_t _dwAddr = _row_addr;
+    if (!_dwAddr) return;
+    _row_addr = 0;
+#if defined(CONFIG_SYS_SLOTS)
+    /* The row is dropped rather than lose the last slot record. */
+    if (!log_keep(_dwAddr)) return;
+#endif
+    nvm_cmd(NVMCTRL_CMD_FLPER_gc);
+    *((uint8_t*)_dwAddr) = 0;
+    nvm_cmd(NVMCTRL_CMD_FLWR_gc);
+    SYS::start_vdd();
+    memcpy((void*)_dwAddr, &_workspace.row_cache[0], page_size(0xC5, _dwAddr));
+    nvm_cmd(NVMCTRL_CMD_NONE_gc);
+    SYS::update_vdd(true);
+#endif
+  }
+
+#if defined(CONFIG_NVM_ROWCACHE)
+
+  size_t row_write (uint16_t _dwAddr, size_t _wLength) {
+    size_t   _psize = page_size(0xC5, _dwAddr);
+    uint16_t _base  = _dwAddr & ~(_psize - 1);
+    uint16_t _ofst  = _dwAddr - _base;
+    if (_ofst + _wLength > _psize) return 0;
+    if (_row_addr != _base) {
+      row_commit();
+      memcpy(&_workspace.row_cache[0], (void*)_base, _psize);
+      _row_addr = _base;
+    }
+    memcpy(&_workspace.row_cache[_ofst], &packet.out.memData[0], _wLength);
+    return 1;
+  }
+
+#endif
+
+  /* EEPROM is erased and written per byte, so no page handling is needed. */
+  /* One operation takes at most an aligned pair, so the data is stored   */
+  /* pair by pair, and nvm_cmd() waits for NVMCTRL to be ready each time. */
+  void eeprom_store (void* _dest, const void* _data, size_t _length) {
+    uint8_t*       _d = (uint8_t*)_dest;
+    const uint8_t* _s = (const uint8_t*)_data;
+    while (_length) {
+      size_t _size = 2 - ((uint16_t)_d & 1);
+      if (_size > _length) _size = _length;
+      nvm_cmd(NVMCTRL_CMD_EEERWR_gc);
+      memcpy(_d, _s, _size);
+      _d += _size;
+      _s += _size;
+      _length -= _size;
+    }
+    nvm_cmd(NVMCTRL_CMD_NONE_gc);
+  }
+
+  /*
+   * CRC-32 of flash, the model used by `gencrc.pl -c6`:
+   * reflected polynomial 0xEDB88320. The caller passes 0xFFFFFFFF as the
+   * initial value and inverts the result. It is computed bit by bit,
+   * because a 1KiB table would not fit in the boot section.
+   */
+  uint32_t crc32_flash (uint32_t _crc, uint16_t _addr, uint16_t _length) {
+    while (_length--) {
+      /* The whole flash takes a few hundred milliseconds. */
+      if (!(uint8_t)_addr) wdt_reset();
+      _crc ^= pgm_read_byte(_addr++);
+      for (uint8_t _i = 0; _i < 8; _i++) {
+        _crc = (_crc >> 1) ^ ((_crc & 1) ? 0xEDB88320UL : 0);
+      }
+    }
+    return _crc;
+  }
+
+  /* A job takes the CRC of [addr, addr + length) one page per step. */
+  void crc_step (void) {
+    uint16_t _size = _nvm_job.length < PROGMEM_PAGE_SIZE ? _nvm_job.length : PROGMEM_PAGE_SIZE;
+    _nvm_job.crc = crc32_flash(_nvm_job.crc, _nvm_job.addr, _size);
+    _nvm_job.addr   += _size;
+    _nvm_job.length -= _size;
+  }
+
   size_t read_memory (void) {
     uint8_t   m_type = packet.out.bMType;
     uint16_t _dwAddr = packet.out.dwAddr;     /* The high-order word is ignored. */
     size_t  _wLength = packet.out.dwLength;
+#if defined(CONFIG_NVM_ROWCACHE)
+    /* A read of the cached row sees it written. */
+    if (_row_addr && m_type != 0xB0 && m_type != 0xC0
+     && _dwAddr < _row_addr + page_size(0xC5, _row_addr)
+     && _dwAddr + _wLength > _row_addr) row_commit();
+#endif
     if (m_type == 0xD3) {
       /* MTYPE_SIB */
       memcpy_P(&packet.in.data[0], &_sib, _wLength);
@@ -83,8 +189,11 @@ namespace NVM::V4 {
     return _wLength + 1;
   }
 
+  /* Parts with up to 32KiB of flash have a single FLMAP section, */
+  /* so the section test below is removed at compile time.        */
+
   void set_flmap (uint16_t &_dwAddr) {
-    if (_dwAddr & 0x8000) {
+    if (DEVICE::Current::flmap_sections > 1 && (_dwAddr & 0x8000)) {
       GPR_GPR0 = NVMCTRL_FLMAP_SECTION1_gc;
     }
     else {
@@ -94,38 +203,325 @@ namespace NVM::V4 {
     _PROTECTED_WRITE(NVMCTRL_CTRLB, GPR_GPR0);
   }
 
+  /*
+   * Map the 32KiB flash section holding `_addr` into data space and return
+   * its data space address. Other NVMCTRL_CTRLB bits are kept as they are.
+   */
+  uint8_t* map_flash (uint16_t _addr) {
+    uint8_t _ctrlb = NVMCTRL_CTRLB & ~NVMCTRL_FLMAP_gm;
+    if (DEVICE::Current::flmap_sections > 1 && (_addr & 0x8000)) _ctrlb |= NVMCTRL_FLMAP_SECTION1_gc;
+    _PROTECTED_WRITE(NVMCTRL_CTRLB, _ctrlb);
+    return (uint8_t*)(_addr | 0x8000);
+  }
+
+  /*
+   * Start erasing the first block of flash pages [_page, _end) with the
+   * largest multi-page erase command that fits its alignment
+   * (32/16/8/4/2/1 pages), and return the number of pages it covers.
+   * Aligned blocks of up to 32 pages (16KiB) never cross an FLMAP section.
+   * No RAM other than the stack is used, so the application services
+   * can share it.
+   */
+  uint8_t erase_block (uint8_t _page, uint8_t _end) {
+    uint8_t _span = 32;
+    uint8_t _cmd  = NVMCTRL_CMD_FLMPER32_gc;
+    while ((_page & (_span - 1)) || _page + _span > _end) {
+      _span >>= 1;
+      _cmd--;
+    }
+    uint8_t* _dummy = map_flash((uint16_t)_page * PROGMEM_PAGE_SIZE);
+    nvm_cmd(_cmd);
+    *_dummy = 0;
+    return _span;
+  }
+
+  /*
+   * The erased range is remembered so that subsequent writes into it
+   * do not need a page erase of their own. The erase itself is a job.
+   */
+  void erase_pages (uint8_t _page, uint8_t _end) {
+#if defined(CONFIG_NVM_CRCFOOTER)
+    _flash_dirty = true;
+#endif
+    if (_page == _erased_end) _erased_end = _end;
+    else {
+      _erased_page = _page;
+      _erased_end  = _end;
+    }
+    _nvm_job.kind   = JOB_ERASE;
+    _nvm_job.result = 1;
+    _nvm_job.addr   = _page;
+    _nvm_job.end    = _end;
+  }
+
+#if defined(CONFIG_SYS_SLOTS)
+
+  // MARK: Application slots
+
+  /*
+   * The application region is split into slot A and slot B of
+   * `slot_pages()` pages each. Every switch appends one record byte to
+   * the erased part of the current log half, and the last valid record
+   * wins. An empty log selects slot A.
+   *
+   * When the current half is full, the record starts the other half, and
+   * only then is the full half erased. If both hold records, the one that
+   * is not full is current; the other half is never left full once a
+   * switch ends, so it can always take one more record without an erase.
+   * A host write that erases the row of the current half first gives the
+   * other half a record of the active slot. A valid record is kept at
+   * every point, so a power failure selects either the old or the new slot.
+   */
+
+  uint8_t slot_pages (void) {
+    return (PROGMEM_PAGES - _bootsize / PROGMEM_PAGE_SIZE) / 2;
+  }
+
+  uint16_t slot_start (uint8_t _slot) {
+    uint8_t _page = _bootsize / PROGMEM_PAGE_SIZE;
+    if (_slot) _page += slot_pages();
+    return (uint16_t)_page * PROGMEM_PAGE_SIZE;
+  }
+
+  /* Number of bytes written in a log half. */
+  uint8_t log_used (const uint8_t* _log) {
+    uint8_t _n = 0;
+    while (_n < SLOT_LOG_SIZE && _log[_n] != 0xFF) _n++;
+    return _n;
+  }
+
+  uint8_t* log_other (uint8_t* _log) {
+    return (uint8_t*)(_log == (uint8_t*)SLOT_LOG0 ? SLOT_LOG1 : SLOT_LOG0);
+  }
+
+  /* Start of the row that holds a log half. */
+  uint16_t log_row (const uint8_t* _log) {
+    return _log == (uint8_t*)SLOT_LOG0 ? BOOTROW_START : USER_SIGNATURES_START;
+  }
+
+  uint8_t* log_current (void) {
+    uint8_t _n0 = log_used((uint8_t*)SLOT_LOG0);
+    uint8_t _n1 = log_used((uint8_t*)SLOT_LOG1);
+    return (uint8_t*)(_n1 && (!_n0 || _n0 == SLOT_LOG_SIZE) ? SLOT_LOG1 : SLOT_LOG0);
+  }
+
+  /* Last valid record in a log half, or `_slot` if there is none. */
+  uint8_t log_scan (const uint8_t* _log, uint8_t _slot) {
+    for (uint8_t _i = 0; _i < SLOT_LOG_SIZE && _log[_i] != 0xFF; _i++) {
+      /* A record torn by a power failure is ignored. */
+      if ((_log[_i] & 0xFE) == 0xA0) _slot = _log[_i] & 1;
+    }
+    return _slot;
+  }
+
+  void log_append (uint8_t* _log, uint8_t _slot) {
+    nvm_cmd(NVMCTRL_CMD_FLWR_gc);
+    _log[log_used(_log)] = 0xA0 | _slot;
+    nvm_cmd(NVMCTRL_CMD_NONE_gc);
+  }
+
+  /*
+   * Erase the row holding a log half, and keep the bytes before the log.
+   * memData[] is the scratch buffer, so this is never called while it
+   * holds host data.
+   */
+  void log_erase (uint8_t* _log) {
+    uint16_t _base = log_row(_log);
+    size_t   _keep = (uint16_t)_log - _base;
+    memcpy(&packet.out.memData[0], (void*)_base, _keep);
+    nvm_cmd(NVMCTRL_CMD_FLPER_gc);
+    *((uint8_t*)_base) = 0;
+    nvm_cmd(NVMCTRL_CMD_FLWR_gc);
+    memcpy((void*)_base, &packet.out.memData[0], _keep);
+    nvm_cmd(NVMCTRL_CMD_NONE_gc);
+  }
+
+  /*
+   * Erase the other half once `_log` is to stay current: when the other
+   * half is full, or when `_log` is and would otherwise lose the choice.
+   */
+  void log_settle (uint8_t* _log) {
+    uint8_t* _other = log_other(_log);
+    uint8_t  _n     = log_used(_other);
+    if (_n && (_n == SLOT_LOG_SIZE || log_used(_log) == SLOT_LOG_SIZE)) log_erase(_other);
+  }
+
+  /* At startup, finish a switch that a reset cut short. */
+  void log_repair (void) {
+    log_settle(log_current());
+  }
+
+  uint8_t active_slot (void) {
+    uint8_t* _log = log_current();
+    /* The older half decides while the current one has no valid record. */
+    return log_scan(_log, log_scan(log_other(_log), 0));
+  }
+
+  bool in_active_slot (uint8_t _page) {
+    uint8_t _start = slot_start(_active_slot) / PROGMEM_PAGE_SIZE;
+    return _page >= _start && _page < _start + slot_pages();
+  }
+
+  /*
+   * Called before the row at `_base` is erased and written again. If it
+   * holds the current half, the other half gets a record of the active
+   * slot first. That half is never full here unless its last record is
+   * already the active slot, so no erase is needed; otherwise the write
+   * is refused.
+   */
+  bool log_keep (uint16_t _base) {
+    uint8_t* _log = log_current();
+    if (log_row(_log) != _base || !log_used(_log)) return true;
+    uint8_t* _other = log_other(_log);
+    if (log_scan(_other, 0xFF) == _active_slot) return true;
+    if (log_used(_other) == SLOT_LOG_SIZE) return false;
+    log_append(_other, _active_slot);
+    return true;
+  }
+
+  bool select_slot (uint8_t _slot) {
+    if (_slot == _active_slot) return true;
+    /* The cached row would otherwise overwrite the new record. */
+    row_commit();
+    /* An erased slot is never selected. */
+    if (pgm_read_word(slot_start(_slot)) == 0xFFFF) return false;
+    uint8_t* _log = log_current();
+    if (log_used(_log) == SLOT_LOG_SIZE) {
+      _log = log_other(_log);
+      if (log_used(_log)) log_erase(_log);
+    }
+    log_append(_log, _slot);
+    log_settle(_log);
+    _active_slot = _slot;
+    return true;
+  }
+
+  /* Does [_dwAddr, _dwAddr + _wLength) touch either log half? */
+  bool in_slot_log (uint16_t _dwAddr, size_t _wLength) {
+    return (_dwAddr < SLOT_LOG0 + SLOT_LOG_SIZE && _dwAddr + _wLength > SLOT_LOG0)
+        || (_dwAddr < SLOT_LOG1 + SLOT_LOG_SIZE && _dwAddr + _wLength > SLOT_LOG1);
+  }
+
+#endif
+
   size_t erase_memory (void) {
-  #ifdef __No_implementation_required__
-    /* Chip erasure is not possible. */
-    /* Page erasure is not necessary outside of terminal mode. */
+    /* The boot section below `_bootsize` is never erased. */
     uint8_t e_type = packet.out.bEType;
     uint16_t _dwAddr = packet.out.dwPageAddr;   /* The high-order word is ignored. */
-    if (e_type == 0x04) {
-      /* XMEGA_ERASE_APP_PAGE */
-      set_flmap(_dwAddr);
-      e_type = 0x07;
+    row_commit();
+    uint8_t _bootpage = _bootsize / PROGMEM_PAGE_SIZE;
+    if (e_type <= 0x01) {
+      /* XMEGA_ERASE_CHIP : Only the application region is erased. */
+      /* XMEGA_ERASE_APP  */
+#if defined(CONFIG_SYS_SLOTS)
+      /* With slots, only the slot that does not start is erased. */
+      _bootpage = slot_start(_active_slot ^ 1) / PROGMEM_PAGE_SIZE;
+      erase_pages(_bootpage, _bootpage + slot_pages());
+#else
+      erase_pages(_bootpage, PROGMEM_PAGES);
+#endif
+    }
+    else if (e_type == 0x04 || e_type == 0x05) {
+      /* XMEGA_ERASE_APP_PAGE  */
+      /* XMEGA_ERASE_BOOT_PAGE */
+      uint8_t _page = _dwAddr / PROGMEM_PAGE_SIZE;
+      /* Past the end of flash, FLMAP would mirror it onto a real page. */
+      if (_page < _bootpage || _page >= PROGMEM_PAGES) return 0;
+#if defined(CONFIG_SYS_SLOTS)
+      if (in_active_slot(_page)) return 0;
+#endif
+      erase_pages(_page, _page + 1);
     }
-    if (e_type == 0x07) {
-      /* XMEGA_ERASE_USERSIG */
+    else if (e_type == 0x07) {
+      /* XMEGA_ERASE_USERSIG : Only USERROW and BOOTROW are accepted. */
+      if (!(_dwAddr >= USER_SIGNATURES_START && _dwAddr < USER_SIGNATURES_START + USER_SIGNATURES_SIZE)
+       && !(_dwAddr >= BOOTROW_START && _dwAddr < BOOTROW_START + BOOTROW_SIZE)) return 0;
+#if defined(CONFIG_SYS_SLOTS)
+      size_t _psize = page_size(0xC5, _dwAddr);
+      if (in_slot_log(_dwAddr & ~(_psize - 1), _psize)) return 0;
+#endif
       nvm_cmd(NVMCTRL_CMD_FLPER_gc);
       *((uint8_t*)_dwAddr) = 0;
-      nvm_cmd(NVMCTRL_CMD_FLWR_gc);
+      nvm_cmd(NVMCTRL_CMD_NONE_gc);
     }
-  #endif
+    else if (e_type == 0x02) {
+      /* XMEGA_ERASE_BOOT */
+      return 0;
+    }
+    /* EEPROM is erased on every write, so there is nothing else to do. */
     return 1;
   }
 
+  /* USERROW and BOOTROW are single pages, so they are erased as a whole. */
+  size_t page_size (uint8_t m_type, uint16_t _dwAddr) {
+    if (m_type == 0xC0) return PROGMEM_PAGE_SIZE;
+    return _dwAddr >= USER_SIGNATURES_START ? USER_SIGNATURES_PAGE_SIZE : BOOTROW_PAGE_SIZE;
+  }
+
+  /*
+   * Merge a partial write with the current page contents.
+   *
+   * The received data is moved to its position within the page image
+   * in memData[], and the rest of the image is filled from the NVM.
+   * The page can then be erased and rewritten without losing anything.
+   * Writes that cross a page boundary are rejected.
+   */
+  bool merge_page (uint16_t &_dwAddr, size_t &_wLength, size_t _psize) {
+    uint16_t _ofst = _dwAddr & (_psize - 1);
+    if (_ofst + _wLength > _psize) return false;
+    if (_wLength != _psize) {
+      uint8_t* _data = &packet.out.memData[0];
+      size_t   _tail = _ofst + _wLength;
+      memmove(_data + _ofst, _data, _wLength);
+      memcpy(_data, (void*)(_dwAddr - _ofst), _ofst);
+      memcpy(_data + _tail, (void*)(_dwAddr + _wLength), _psize - _tail);
+      _dwAddr -= _ofst;
+      _wLength = _psize;
+    }
+    return true;
+  }
+
   size_t write_memory (void) {
     uint8_t   m_type = packet.out.bMType;
     uint16_t _dwAddr = packet.out.dwAddr;     /* The high-order word is ignored. */
     size_t  _wLength = packet.out.dwLength;
     DFLUSH();
+    bool _erase = true;
+    uint8_t _commit = 0;
     if (m_type == 0xB0) {
       /* MTYPE_FLASH_PAGE (PROGMEM) */
       if (_dwAddr < _bootsize) return 1;
+      /* Pages already erased by CMD3_ERASE_MEMORY are only written. */
+      uint8_t _page = _dwAddr / PROGMEM_PAGE_SIZE;
+      if (_page >= PROGMEM_PAGES) return 0;
+#if defined(CONFIG_SYS_SLOTS)
+      if (in_active_slot(_page)) return 0;
+#endif
+#if defined(CONFIG_NVM_JOURNAL)
+      /* A whole page written at the journal position advances it. */
+      if (_page == JOURNAL->next && _wLength == PROGMEM_PAGE_SIZE) _commit = _page + 1;
+#endif
+      if (_page >= _erased_page && _page < _erased_end) {
+        _erased_page = _page + 1;
+        _erase = false;
+      }
+#if defined(CONFIG_NVM_CRCFOOTER)
+      _flash_dirty = true;
+#endif
       set_flmap(_dwAddr);
       m_type = 0xC0;
     }
+    else if (m_type == 0xC0) {
+      /* MTYPE_FLASH (alias) : flash through the mapped data space window. */
+      if (_dwAddr < 0x8000) return 0;
+#if defined(CONFIG_SYS_SLOTS)
+      /* The page it reaches is protected as for MTYPE_FLASH_PAGE. */
+      uint8_t _page = (_dwAddr & 0x7FFF) / PROGMEM_PAGE_SIZE;
+      if (DEVICE::Current::flmap_sections > 1
+       && (NVMCTRL_CTRLB & NVMCTRL_FLMAP_gm) == NVMCTRL_FLMAP_SECTION1_gc) _page += 0x8000 / PROGMEM_PAGE_SIZE;
+      if (in_active_slot(_page & (PROGMEM_PAGES - 1))) return 0;
+#endif
+    }
 
     if (m_type == 0x22 || m_type == 0xC4) {
       /* MTYPE_EEPROM */
@@ -135,66 +531,474 @@ namespace NVM::V4 {
     else if (m_type == 0xC0 || m_type == 0xC5) {
       /* MTYPE_FLASH (alias) */
       /* MTYPE_USERSIG (USERROW, BOOTROW) */
-      nvm_cmd(NVMCTRL_CMD_FLPER_gc);
-      *((uint8_t*)_dwAddr) = 0;
+#if defined(CONFIG_SYS_SLOTS)
+      if (in_slot_log(_dwAddr, _wLength)) return 0;
+#endif
+#if defined(CONFIG_NVM_ROWCACHE)
+      if (m_type == 0xC5) return row_write(_dwAddr, _wLength);
+#endif
+      if (!merge_page(_dwAddr, _wLength, page_size(m_type, _dwAddr))) return 0;
+#if defined(CONFIG_SYS_SLOTS)
+      if (m_type == 0xC5 && !log_keep(_dwAddr)) return 0;
+#endif
+      if (_erase) {
+        nvm_cmd(NVMCTRL_CMD_FLPER_gc);
+        *((uint8_t*)_dwAddr) = 0;
+      }
       nvm_cmd(NVMCTRL_CMD_FLWR_gc);
     }
 
+    SYS::start_vdd();
     memcpy((void*)_dwAddr, &packet.out.memData[0], _wLength);
     nvm_cmd(NVMCTRL_CMD_NONE_gc);
+    SYS::update_vdd(true);
 
+#if defined(CONFIG_NVM_JOURNAL)
+    if (_commit) eeprom_store(&JOURNAL->next, &_commit, 1);
+#endif
     return 1;
   }
 
+#if defined(CONFIG_NVM_FILLCOPY)
+
+  /*
+   * CMD3_VENDOR_FILL (0xE2) and CMD3_VENDOR_COPY (0xE3)
+   *
+   *   FILL : [reserved] [MTYPE] [ADDR x 4] [LEN x 4] [reserved] [PATTERN ...]
+   *   COPY : [reserved] [MTYPE] [ADDR x 4] [LEN x 4] [SRC_MTYPE] [SRC_ADDR x 4]
+   *
+   * The header is the same as CMD3_WRITE_MEMORY. The destination range is
+   * split at page boundaries (EEPROM at 2-byte pairs), and each piece is
+   * staged in memData[] and passed to write_memory() by one job step, so
+   * merging, erasing and protection work as for a host write. The pattern
+   * repeats from the start of the range. Copy ranges must not overlap.
+   * Flash is only written as MTYPE_FLASH_PAGE (0xB0), because 0xC0 is a
+   * data space address for write_memory() but a program address for a
+   * copy source. A range is less than 64KiB.
+   */
+  size_t fill_memory (bool _copy) {
+    uint8_t   m_type = packet.out.bMType;
+    size_t    _plen  = _packet_length - 17;
+    if (m_type != 0xB0 && m_type != 0x22 && m_type != 0xC4 && m_type != 0xC5) return 0;
+    if (packet.out.dwLength > 0xFFFF) return 0;
+    if (_copy) {
+      if (_packet_length < 21) return 0;        /* SRC_ADDR */
+      /* A cached row must be in the NVM before it is read. */
+      if (packet.out.reserve3 != 0xB0 && packet.out.reserve3 != 0xC0) row_commit();
+    }
+    else {
+      if (_packet_length <= 17
+       || _plen > sizeof(_workspace.work_data) - FILL_PATTERN_OFFSET) return 0;
+      memcpy(&_workspace.work_data[FILL_PATTERN_OFFSET], &packet.out.memData[0], _plen);
+    }
+    _nvm_job.kind   = _copy ? JOB_COPY : JOB_FILL;
+    _nvm_job.result = 1;
+    _nvm_job.m_type = m_type;
+    _nvm_job.s_type = packet.out.reserve3;
+    _nvm_job.addr   = packet.out.dwAddr;      /* The high-order word is ignored. */
+    _nvm_job.length = packet.out.dwLength;
+    _nvm_job.source = _CAPS16(packet.out.memData[0])->word;
+    _nvm_job.plen   = _plen;
+    _nvm_job.phase  = 0;
+    return 1;
+  }
+
+  size_t fill_step (void) {
+    uint8_t   m_type = _nvm_job.m_type;
+    uint8_t   s_type = _nvm_job.s_type;
+    uint16_t _dwAddr = _nvm_job.addr;
+    size_t _psize = m_type == 0xC5 ? page_size(0xC5, _dwAddr)
+                  : (m_type == 0x22 || m_type == 0xC4) ? 2 : PROGMEM_PAGE_SIZE;
+    size_t _size  = _psize - (_dwAddr & (_psize - 1));
+    if (_size > _nvm_job.length) _size = _nvm_job.length;
+    uint8_t* _data = &packet.out.memData[0];
+    if (_nvm_job.kind == JOB_FILL) {
+      uint8_t* _pattern = &_workspace.work_data[FILL_PATTERN_OFFSET];
+      for (size_t _i = 0; _i < _size; _i++) {
+        _data[_i] = _pattern[_nvm_job.phase];
+        if (++_nvm_job.phase == _nvm_job.plen) _nvm_job.phase = 0;
+      }
+    }
+    else if (s_type == 0xB0 || s_type == 0xC0) {
+      memcpy_P(_data, (void*)_nvm_job.source, _size);
+    }
+    else {
+      memcpy(_data, (void*)_nvm_job.source, _size);
+    }
+    packet.out.bMType = m_type;
+    packet.out.dwAddr = _dwAddr;
+    packet.out.dwLength = _size;
+    _nvm_job.source += _size;
+    _nvm_job.addr   += _size;
+    _nvm_job.length -= _size;
+    return write_memory();
+  }
+
+#endif
+
+#if defined(CONFIG_NVM_PAGESERVICE)
+
+  // MARK: Application services
+
+  /*
+   * Whole-page flash services exported through the vector table.
+   * They run on behalf of the application, so they use nothing but their
+   * arguments and the stack. The boot section is taken from FUSE_BOOTSIZE
+   * (in 512-byte pages), not from `_bootsize`.
+   */
+
+  void erase_span (uint8_t _page, uint8_t _end) {
+    while (_page < _end) _page += erase_block(_page, _end);
+    nvm_cmd(NVMCTRL_CMD_NONE_gc);
+  }
+
+  bool app_pages (uint16_t _addr, uint8_t _pages) {
+    uint8_t _page = _addr / PROGMEM_PAGE_SIZE;
+    return !(_addr & (PROGMEM_PAGE_SIZE - 1))
+      && _pages
+      && _page >= FUSE_BOOTSIZE
+      && _page + _pages <= PROGMEM_PAGES;
+  }
+
+  void program_page (uint16_t _addr, const void* _data) {
+    uint8_t* _dest = map_flash(_addr);
+    nvm_cmd(NVMCTRL_CMD_FLWR_gc);
+    memcpy(_dest, _data, PROGMEM_PAGE_SIZE);
+    nvm_cmd(NVMCTRL_CMD_NONE_gc);
+  }
+
+  uint8_t service_end (uint8_t _ctrlb, uint8_t _sreg) {
+    uint8_t _error = NVMCTRL_STATUS & NVMCTRL_ERROR_gm;
+    _PROTECTED_WRITE(NVMCTRL_CTRLB, _ctrlb);
+    SREG = _sreg;
+    return _error;
+  }
+
+#endif
+
   // MARK: JTAG SCOPE
 
+  size_t rsp3_status (size_t _rspsize) {
+    packet.in.res = _rspsize ? 0x80 : 0xA0;     /* RSP3_OK : RSP3_FAILED */
+    return _rspsize;
+  }
+
+  size_t updi_sign_on (void) {
+    D1PRINTF(" UPDI_SIGN_ON=EXT:%02X\r\n", packet.out.bMType);
+    memcpy_P(&packet.in.data[0], &_sib[0], 4);
+    packet.in.res = 0x84;           /* RSP3_DATA */
+    return 5;
+  }
+
+  size_t updi_sign_off (void) {
+    D1PRINTF(" UPDI_SIGN_OFF\r\n");
+    row_commit();
+    /* If UPDI control has failed, RSP3_OK is always returned. */
+    return rsp3_status(1);
+  }
+
+  size_t updi_enter_progmode (void) {
+    D1PRINTF(" UPDI_ENTER_PROG\r\n");
+    /* On failure, RSP3_OK is returned if a UPDI connection is available. */
+    return rsp3_status(1);
+  }
+
+#if defined(CONFIG_NVM_CRCFOOTER)
+
+  /*
+   * The footer is the inverted CRC-32 of all flash but the last 4 bytes,
+   * stored there little-endian, so that the CRC of the whole flash ends
+   * on the model residue. It is computed from the flash contents rather
+   * than from the received pages, which may arrive partial or out of order.
+   * With slots, the footer covers only the slot being programmed and is
+   * stored at its end. CRCSCAN cannot check a slot on its own, so that
+   * footer is for a software check of the slot.
+   */
+  void write_footer (void) {
+    _nvm_job.kind   = JOB_FOOTER;
+    _nvm_job.result = 1;
+#if defined(CONFIG_SYS_SLOTS)
+    _nvm_job.addr   = slot_start(_active_slot ^ 1);
+    _nvm_job.length = (uint16_t)slot_pages() * PROGMEM_PAGE_SIZE - 4;
+#else
+    _nvm_job.addr   = 0;
+    _nvm_job.length = PROGMEM_SIZE - 4;
+#endif
+    _nvm_job.crc    = 0xFFFFFFFFUL;
+  }
+
+  /*
+   * The CRC is taken one page per step. The last step stores it at the
+   * address that follows, through write_memory(), so the page is merged
+   * and the erased page window is kept up to date as for a host write.
+   */
+  void footer_step (void) {
+    crc_step();
+    if (_nvm_job.length) return;
+    uint32_t _crc = ~_nvm_job.crc;
+    memcpy(&packet.out.memData[0], &_crc, 4);
+    packet.out.bMType = 0xB0;
+    packet.out.dwAddr = _nvm_job.addr;
+    packet.out.dwLength = 4;
+    if (!write_memory()) _nvm_job.result = 0;
+    /* The footer itself does not make the flash dirty. */
+    _flash_dirty = false;
+  }
+
+#endif
+
+#if defined(CONFIG_NVM_JOURNAL)
+
+  /*
+   * CMD3_VENDOR_JOURNAL (0xE4)
+   *
+   *   Request  : [reserved] [OP] [IMAGE x 4] [PAGE]
+   *   Response : [IMAGE x 4] [FIRST] [NEXT] [CRC x 4]
+   *
+   * OP=1 starts a journal for IMAGE from PAGE, OP=2 clears it, and any
+   * other OP only queries. Every whole flash page written at NEXT moves
+   * NEXT on by one, so after an interruption the host resumes from NEXT.
+   * CRC is the CRC-32 of the flash in [FIRST, NEXT), so the host can check
+   * it against its own image first. Up to the whole flash may be covered,
+   * so it is taken by a job, and the response is built when the job ends.
+   */
+  size_t journal_response (void) {
+    uint32_t _crc = ~_nvm_job.crc;
+    memcpy(&packet.in.data[0], (void*)&JOURNAL->image, 4);
+    packet.in.data[4] = JOURNAL->first;
+    packet.in.data[5] = JOURNAL->next;
+    memcpy(&packet.in.data[6], &_crc, 4);
+    packet.in.res = 0x184;          /* RSP3_DATA */
+    return 11;
+  }
+
+  size_t updi_journal (void) {
+    uint8_t _op = packet.out.data[1];
+    Journal_t _journal;
+    memcpy(&_journal.image, &packet.out.data[2], 4);
+    _journal.first = _journal.next = packet.out.data[6];
+    D1PRINTF(" UPDI_JOURNAL=%02X:%02X\r\n", _op, _journal.first);
+    if (_op == 1 || _op == 2) {
+      if (_op == 2) memset(&_journal, 0xFF, sizeof(Journal_t));
+      else if (_journal.first < _bootsize / PROGMEM_PAGE_SIZE
+            || _journal.first >= PROGMEM_PAGES) return rsp3_status(0);
+      eeprom_store(JOURNAL, &_journal, sizeof(Journal_t));
+    }
+    uint8_t _first = JOURNAL->first;
+    uint8_t _next  = JOURNAL->next;
+    _nvm_job.kind   = JOB_JOURNAL;
+    _nvm_job.addr   = (uint16_t)_first * PROGMEM_PAGE_SIZE;
+    _nvm_job.length = 0;
+    /* An empty or invalid range reports a CRC of 0. */
+    if (_first < _next && _next <= PROGMEM_PAGES) {
+      _nvm_job.length = (uint16_t)(_next - _first) * PROGMEM_PAGE_SIZE;
+    }
+    _nvm_job.crc    = 0xFFFFFFFFUL;
+    return 0;
+  }
+
+#endif
+
+  // MARK: NVM jobs
+
+  /*
+   * A job is started by a command handler and advanced by job_step()
+   * until job_busy() turns false; that last call returns the response
+   * size. A step is only taken when NVMCTRL is ready, and starts at most
+   * one erase block, one page write or one EEPROM pair.
+   */
+  bool job_busy (void) {
+    return _nvm_job.kind != JOB_NONE;
+  }
+
+  size_t job_step (void) {
+    if (NVMCTRL_STATUS & 3) return 0;           /* FLBUSY | EEBUSY */
+    uint8_t _kind = _nvm_job.kind;
+    if (_kind == JOB_ERASE) {
+      if (_nvm_job.addr < _nvm_job.end) {
+        SYS::start_vdd();
+        _nvm_job.addr += erase_block(_nvm_job.addr, _nvm_job.end);
+        return 0;
+      }
+      nvm_cmd(NVMCTRL_CMD_NONE_gc);
+      SYS::update_vdd(true);
+    }
+#if defined(CONFIG_NVM_CRCFOOTER)
+    else if (_kind == JOB_FOOTER) {
+      footer_step();
+      if (_nvm_job.length) return 0;
+    }
+#endif
+#if defined(CONFIG_NVM_JOURNAL)
+    else if (_kind == JOB_JOURNAL) {
+      if (_nvm_job.length) {
+        crc_step();
+        return 0;
+      }
+      _nvm_job.kind = JOB_NONE;
+      return journal_response();
+    }
+#endif
+#if defined(CONFIG_NVM_FILLCOPY)
+    else if (_nvm_job.length) {                 /* JOB_FILL, JOB_COPY */
+      if (!fill_step()) _nvm_job.result = _nvm_job.length = 0;
+      return 0;
+    }
+#endif
+    _nvm_job.kind = JOB_NONE;
+    return rsp3_status(_nvm_job.result);
+  }
+
+  size_t updi_leave_progmode (void) {
+    D1PRINTF(" UPDI_LEAVE_PROG\r\n");
+    /* Only the row cache and the CRCSCAN footer are written here. */
+    /* The actual termination process is delayed until CMD3_SIGN_OFF. */
+    row_commit();
+#if defined(CONFIG_NVM_CRCFOOTER)
+    if (_flash_dirty) {
+      _flash_dirty = false;
+      write_footer();
+    }
+#endif
+    return rsp3_status(1);
+  }
+
+  size_t updi_erase (void) {
+    D1PRINTF(" UPDI_ERASE=%02X:%06lX\r\n",
+      packet.out.bEType, packet.out.dwPageAddr);
+    return rsp3_status(erase_memory());
+  }
+
+  size_t updi_read (void) {
+    D1PRINTF(" UPDI_READ=%02X:%06lX:%04X\r\n", packet.out.bMType,
+      packet.out.dwAddr, (size_t)packet.out.dwLength);
+    size_t _rspsize = read_memory();
+    packet.in.res = 0x184;          /* RSP3_DATA */
+    return _rspsize;
+  }
+
+  size_t updi_write (void) {
+    D1PRINTF(" UPDI_WRITE=%02X:%06lX:%04X\r\n", packet.out.bMType,
+      packet.out.dwAddr, (size_t)packet.out.dwLength);
+    return rsp3_status(write_memory());
+  }
+
+#if defined(CONFIG_NVM_FILLCOPY)
+
+  size_t updi_fill (void) {
+    D1PRINTF(" UPDI_FILL=%02X:%06lX:%04X\r\n", packet.out.bMType,
+      packet.out.dwAddr, (size_t)packet.out.dwLength);
+    return rsp3_status(fill_memory(false));
+  }
+
+  size_t updi_copy (void) {
+    D1PRINTF(" UPDI_COPY=%02X:%06lX:%04X\r\n", packet.out.bMType,
+      packet.out.dwAddr, (size_t)packet.out.dwLength);
+    return rsp3_status(fill_memory(true));
+  }
+
+#endif
+
+  size_t updi_failed (void) {
+    return rsp3_status(0);
+  }
+
   /* ARCH=UPDI scope Provides functionality. */
+  /* To register a new command, add a record before the terminator. */
+  constexpr JTAG_Dispatch_t PROGMEM updi_table[] = {
+    { 0x10, &updi_sign_on          }, /* CMD3_SIGN_ON */
+    { 0x11, &updi_sign_off         }, /* CMD3_SIGN_OFF */
+    { 0x15, &updi_enter_progmode   }, /* CMD3_ENTER_PROGMODE */
+    { 0x16, &updi_leave_progmode   }, /* CMD3_LEAVE_PROGMODE */
+    { 0x20, &updi_erase            }, /* CMD3_ERASE_MEMORY */
+    { 0x21, &updi_read             }, /* CMD3_READ_MEMORY */
+    { 0x23, &updi_write            }, /* CMD3_WRITE_MEMORY */
+  #if defined(CONFIG_NVM_FILLCOPY)
+    { 0xE2, &updi_fill             }, /* CMD3_VENDOR_FILL (euboot) */
+    { 0xE3, &updi_copy             }, /* CMD3_VENDOR_COPY (euboot) */
+  #endif
+  #if defined(CONFIG_NVM_JOURNAL)
+    { 0xE4, &updi_journal          }, /* CMD3_VENDOR_JOURNAL (euboot) */
+  #endif
+    { 0xFF, &updi_failed           }
+  };
+  static_assert(jtag_dispatch_valid(updi_table), "updi_table");
+
   size_t jtag_scope_updi (void) {
-    size_t _rspsize = 0;
-    uint8_t _cmd = packet.out.cmd;
-    if (_cmd == 0x10) {             /* CMD3_SIGN_ON */
-      D1PRINTF(" UPDI_SIGN_ON=EXT:%02X\r\n", packet.out.bMType);
-      memcpy_P(&packet.in.data[0], &_sib[0], 4);
-      packet.in.res = 0x84;         /* RSP3_DATA */
-      return 5;
-    }
-    else if (_cmd == 0x11) {        /* CMD3_SIGN_OFF */
-      D1PRINTF(" UPDI_SIGN_OFF\r\n");
-      /* If UPDI control has failed, RSP3_OK is always returned. */
-      _rspsize = 1;
-    }
-    else if (_cmd == 0x15) {        /* CMD3_ENTER_PROGMODE */
-      D1PRINTF(" UPDI_ENTER_PROG\r\n");
-      /* On failure, RSP3_OK is returned if a UPDI connection is available. */
-      _rspsize = 1;
-    }
-    else if (_cmd == 0x16) {        /* CMD3_LEAVE_PROGMODE */
-      D1PRINTF(" UPDI_LEAVE_PROG\r\n");
-      /* There is nothing to do. */
-      /* The actual termination process is delayed until CMD3_SIGN_OFF. */
-      _rspsize = 1;
-    }
-    else if (_cmd == 0x20) {        /* CMD3_ERASE_MEMORY */
-      D1PRINTF(" UPDI_ERASE=%02X:%06lX\r\n",
-        packet.out.bEType, packet.out.dwPageAddr);
-      _rspsize = erase_memory();
-    }
-    else if (_cmd == 0x21) {        /* CMD3_READ_MEMORY */
-      D1PRINTF(" UPDI_READ=%02X:%06lX:%04X\r\n", packet.out.bMType,
-        packet.out.dwAddr, (size_t)packet.out.dwLength);
-      _rspsize = read_memory();
-      packet.in.res = 0x184;        /* RSP3_DATA */
-      return _rspsize;
-    }
-    else if (_cmd == 0x23) {        /* CMD3_WRITE_MEMORY */
-      D1PRINTF(" UPDI_WRITE=%02X:%06lX:%04X\r\n", packet.out.bMType,
-        packet.out.dwAddr, (size_t)packet.out.dwLength);
-      _rspsize = write_memory();
+    return JTAG::dispatch(updi_table, packet.out.cmd);
+  }
+
+};
+
+#if defined(CONFIG_NVM_PAGESERVICE)
+
+/*
+ * Exported entry points (see the SPM snippet table in README.md).
+ * Each returns 0 on success, 0xFF if the range is not whole application
+ * pages, or the NVMCTRL_STATUS error field. Interrupts are held off while
+ * FLMAP is switched, and SREG and NVMCTRL_CTRLB are restored on return.
+ */
+
+extern "C" {
+
+  /* $28: Erase one page and write it from a 512-byte RAM buffer. */
+  __attribute__((used))
+  uint8_t nvm_page_write (uint16_t _addr, const void* _data) {
+    if (!NVM::V4::app_pages(_addr, 1)) return 0xFF;
+    uint8_t _sreg  = SREG;
+    uint8_t _ctrlb = NVMCTRL_CTRLB;
+    __asm__ __volatile__ ( "CLI" );
+    uint8_t _page = _addr / PROGMEM_PAGE_SIZE;
+    NVM::V4::erase_span(_page, _page + 1);
+    NVM::V4::program_page(_addr, _data);
+    return NVM::V4::service_end(_ctrlb, _sreg);
+  }
+
+  /* $2A: Erase `_pages` pages with multi-page erase commands. */
+  __attribute__((used))
+  uint8_t nvm_page_erase (uint16_t _addr, uint8_t _pages) {
+    if (!NVM::V4::app_pages(_addr, _pages)) return 0xFF;
+    uint8_t _sreg  = SREG;
+    uint8_t _ctrlb = NVMCTRL_CTRLB;
+    __asm__ __volatile__ ( "CLI" );
+    uint8_t _page = _addr / PROGMEM_PAGE_SIZE;
+    NVM::V4::erase_span(_page, _page + _pages);
+    return NVM::V4::service_end(_ctrlb, _sreg);
+  }
+
+  /*
+   * $2C: Write one page only where it differs.
+   * An identical page is left untouched. If the new data only clears
+   * bits, the page is written without an erase; otherwise it is erased
+   * and written like nvm_page_write.
+   */
+  __attribute__((used))
+  uint8_t nvm_page_update (uint16_t _addr, const void* _data) {
+    if (!NVM::V4::app_pages(_addr, 1)) return 0xFF;
+    const uint8_t* _src = (const uint8_t*)_data;
+    bool _same  = true;
+    bool _erase = false;
+    for (uint16_t _i = 0; _i < PROGMEM_PAGE_SIZE; _i++) {
+      uint8_t _old = pgm_read_byte(_addr + _i);
+      if (_old == _src[_i]) continue;
+      _same = false;
+      if (_src[_i] & ~_old) {
+        _erase = true;
+        break;
+      }
     }
-    packet.in.res = _rspsize ? 0x80 : 0xA0;     /* RSP3_OK : RSP3_FAILED */
-    return _rspsize;
+    if (_same) return 0;
+    uint8_t _sreg  = SREG;
+    uint8_t _ctrlb = NVMCTRL_CTRLB;
+    __asm__ __volatile__ ( "CLI" );
+    uint8_t _page = _addr / PROGMEM_PAGE_SIZE;
+    if (_erase) NVM::V4::erase_span(_page, _page + 1);
+    NVM::V4::program_page(_addr, _data);
+    return NVM::V4::service_end(_ctrlb, _sreg);
   }
 
 };
 
+#endif
+
 // end of code
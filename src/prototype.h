@@ -30,6 +30,7 @@
 #include <setjmp.h>
 #include <api/memspace.h>
 #include "configuration.h"
+#include "device.h"
 
 // #undef DEBUG
 // #define DEBUG 3
@@ -87,6 +88,33 @@
 #define USB_EP_STATUS_CLR(EPFIFO) _SFR_MEM8(&USB0_STATUS0_OUTCLR + ((EPFIFO) >> 2))
 #define USB_EP_STATUS_SET(EPFIFO) _SFR_MEM8(&USB0_STATUS0_OUTSET + ((EPFIFO) >> 2))
 
+/* Fallback for device headers that do not define the BOOTROW geometry. */
+#ifndef BOOTROW_START
+  #define BOOTROW_START     0x1100
+  #define BOOTROW_SIZE      256
+#endif
+#ifndef BOOTROW_PAGE_SIZE
+  #define BOOTROW_PAGE_SIZE BOOTROW_SIZE
+#endif
+
+#define PROGMEM_PAGES (DEVICE::Current::flash_size / DEVICE::Current::page_size)
+
+/* ABI version 2 extends the table of version 1. */
+#if defined(CONFIG_USB_APPTABLE) && !defined(CONFIG_NVM_PAGESERVICE)
+  #error "CONFIG_USB_APPTABLE requires CONFIG_NVM_PAGESERVICE"
+#endif
+
+/* USERROW/BOOTROW write cache */
+#define ROW_CACHE_SIZE (USER_SIGNATURES_PAGE_SIZE > BOOTROW_PAGE_SIZE ? USER_SIGNATURES_PAGE_SIZE : BOOTROW_PAGE_SIZE)
+
+#if defined(CONFIG_SYS_SLOTS)
+  /* Slot log: one record byte (0xA0 | slot) per switch, in two halves */
+  /* at the end of BOOTROW and of USERROW, which are erased separately. */
+  #define SLOT_LOG_SIZE  16
+  #define SLOT_LOG0      (BOOTROW_START + BOOTROW_SIZE - SLOT_LOG_SIZE)
+  #define SLOT_LOG1      (USER_SIGNATURES_START + USER_SIGNATURES_SIZE - SLOT_LOG_SIZE)
+#endif
+
 #define USB_ENDPOINTS_MAX 3
 
 /* In the internal representation of an endpoint number, */
@@ -176,24 +204,56 @@ typedef struct {
   uint16_t wLength;
 } PACKED Setup_Packet_t;
 
+/*
+ * Workspace arena
+ *
+ * All working buffers live in one .noinit object. EP0 data stages only
+ * occur outside a JTAG session (enumeration and HID class requests), so
+ * the EP0 response buffer and the JTAG scratch area share storage.
+ * DAP buffers stay separate because DAP_ExecuteCommands runs JTAG commands
+ * while its queue is still being read.
+ */
 typedef struct {
-  Setup_Packet_t req_data;
+  Setup_Packet_t req_data;    /* EP0 SETUP */
+  uint8_t dap_data[64];       /* DAP IN/OUT */
+#if defined(CONFIG_DAP_QUEUE)
+  uint8_t dap_queue[64];      /* DAP_ExecuteCommands request */
+#endif
   union {
-    uint8_t res_data[256 + 16];
-    struct {
-      struct {
-        Setup_Packet_t cci_header;
-        uint16_t cci_wValue;
-      };
-      uint8_t dap_data[64];   /* DAP IN/OUT */
-    };
+    uint8_t res_data[64];     /* EP0 phase: descriptors and short replies */
+#if defined(CONFIG_JTAG_BATCH) || defined(CONFIG_NVM_FILLCOPY)
+    uint8_t work_data[128];   /* JTAG phase: batch results or the fill pattern */
+#endif
   };
-} PACKED EP_DATA_t;
+  JTAG_Packet_t jtag;         /* JTAG payload and flash page staging */
+#if defined(CONFIG_NVM_ROWCACHE)
+  uint8_t row_cache[ROW_CACHE_SIZE];  /* image of the row at _row_addr */
+#endif
+} PACKED Workspace_t;
 
 typedef struct {
   USB_EP_PAIR_t EP[USB_ENDPOINTS_MAX];        /* USB Device Controller EP */
 } PACKED EP_TABLE_t;
 
+#if defined(CONFIG_USB_APPTABLE)
+/*
+ * Application USB context (ABI version 2)
+ *
+ * Owned by the application. The EP0 SETUP and response buffers are the
+ * DATAPTR of ep_table[0].OUT and ep_table[0].IN. Both callbacks return
+ * the number of bytes placed in `_buffer`, or a negative value (for
+ * `request`) / 0 (for `descriptor`) to leave the request unanswered.
+ */
+typedef struct {
+  USB_EP_PAIR_t* ep_table;                /* RAM, 2-byte aligned */
+  const USB_EP_PAIR_t* ep_init;           /* PROGMEM image of ep_table */
+  size_t (*descriptor)(uint8_t* _buffer, uint16_t _index);
+  int16_t (*request)(const Setup_Packet_t* _req, uint8_t* _buffer);
+  uint8_t ep_count;                       /* endpoint pairs, 1 to 16 */
+  uint8_t config;                         /* value of SET_CONFIGURATION */
+} PACKED USB_App_t;
+#endif
+
 /* UPDI device descriptor */
 typedef struct {
   uint16_t prog_base;
@@ -236,6 +296,65 @@ typedef struct {
   };
 } PACKED Device_Desc_t;
 
+/* Diagnostic counters, readable through the EDBG scope (section 0x80) */
+typedef struct {
+  uint16_t retransmits;       /* commands received again with the same sequence (REPLAY) */
+  uint16_t replays;           /* NVM commands answered from the response cache (REPLAY) */
+  uint16_t vdd_min;           /* lowest VDD sampled across NVM operations (mV) */
+  uint16_t vdd_max;           /* highest VDD sampled across NVM operations (mV) */
+} PACKED Diag_t;
+
+#if defined(CONFIG_NVM_JOURNAL)
+/* Programming journal, at the end of EEPROM */
+typedef struct {
+  uint32_t image;             /* image identifier from the host, 0xFFFFFFFF:none */
+  uint8_t  first;             /* first flash page of the image */
+  uint8_t  next;              /* first flash page not yet written */
+} PACKED Journal_t;
+
+#define JOURNAL ((Journal_t*)(EEPROM_START + EEPROM_SIZE - sizeof(Journal_t)))
+#endif
+
+/* Multi-step NVM job */
+typedef struct {
+  uint8_t  kind;              /* 0:idle */
+  uint8_t  result;            /* 0 once a step has failed */
+  uint8_t  m_type;            /* destination memory type */
+  uint8_t  s_type;            /* copy source memory type */
+  uint16_t addr;              /* next page (erase) or address */
+  uint16_t length;            /* bytes left */
+  uint16_t source;            /* copy source address */
+  uint8_t  end;               /* erase end page */
+  uint8_t  plen;              /* fill pattern length */
+  uint8_t  phase;             /* fill pattern position */
+  uint32_t crc;               /* footer or journal CRC so far */
+} PACKED NVM_Job_t;
+
+/* The fill pattern is staged in work_data. A background job keeps */
+/* it clear of res_data, because EP0 is served while it runs.      */
+#if defined(CONFIG_NVM_BACKGROUND)
+#define FILL_PATTERN_OFFSET sizeof(EP_MEM.res_data)
+#else
+#define FILL_PATTERN_OFFSET 0
+#endif
+
+/* JTAG3 command dispatch record */
+/* Tables are placed in PROGMEM and terminated by code 0xFF, */
+/* whose handler is the default for unlisted codes (or NULL). */
+typedef size_t (*JTAG_Handler_t)(void);
+
+typedef struct {
+  uint8_t code;
+  JTAG_Handler_t handler;
+} PACKED JTAG_Dispatch_t;
+
+template <size_t N>
+constexpr bool jtag_dispatch_valid (const JTAG_Dispatch_t (&_table)[N], size_t _i = 0) {
+  return _i == N - 1
+    ? _table[_i].code == 0xFF
+    : _table[_i].code != 0xFF && jtag_dispatch_valid(_table, _i + 1);
+}
+
 /*
  * Global workspace
  */
@@ -248,15 +367,17 @@ extern "C" {
     extern uint8_t _led_next;
     extern uint8_t _led_mask;
     extern uint16_t _bootsize;
+    extern uint16_t _vdd;         /* averaged VDD (mV) */
+    extern bool _vdd_nvm;         /* the pending sample overlaps an NVM operation */
+
+    /* Workspace arena */
+    extern Workspace_t _workspace;
 
     /* USB */
     extern EP_TABLE_t EP_TABLE;
-    extern EP_DATA_t EP_MEM;
-    extern Device_Desc_t Device_Descriptor;
     extern uint8_t _set_config;
 
     /* JTAG packet payload */
-    extern JTAG_Packet_t packet;
     extern size_t  _packet_length;
     extern uint8_t _packet_fragment;
     extern uint8_t _packet_chunks;
@@ -264,25 +385,82 @@ extern "C" {
 
     /* JTAG parameter */
     extern uint32_t _before_page; /* before flash page section */
+    extern uint8_t _erased_page;  /* known erased flash pages [_erased_page, _erased_end) */
+    extern uint8_t _erased_end;
     extern uint8_t _jtag_arch;    /* 5:ARCH */
     extern uint8_t _jtag_conn;
 
+  #if defined(CONFIG_JTAG_REPLAY)
+    /* JTAG response cache (last NVM command) */
+    extern uint16_t _last_sequence;
+    extern uint16_t _last_res;
+    extern uint8_t _last_cmd;     /* 0:empty */
+    extern uint8_t _last_rspsize;
+  #endif
+    extern Diag_t _diag;
+
+    /* NVM job */
+    extern NVM_Job_t _nvm_job;
+
+  #if defined(CONFIG_NVM_ROWCACHE)
+    extern uint16_t _row_addr;    /* cached row, 0:empty */
+  #endif
+
+  #if defined(CONFIG_NVM_CRCFOOTER)
+    extern bool _flash_dirty;     /* flash changed since the last footer */
+  #endif
+
+  #if defined(CONFIG_SYS_SLOTS)
+    extern uint8_t _active_slot;  /* slot that starts: 0:A 1:B */
+  #endif
+
   } /* NAMELESS */;
 
+  /* Phase views into the workspace arena */
+  #define EP_MEM _workspace
+  #define packet _workspace.jtag
+
   extern void nvm_cmd (uint8_t _nvm_cmd);
+#if defined(CONFIG_NVM_PAGESERVICE)
+  extern uint8_t nvm_page_write (uint16_t _addr, const void* _data);
+  extern uint8_t nvm_page_erase (uint16_t _addr, uint8_t _pages);
+  extern uint8_t nvm_page_update (uint16_t _addr, const void* _data);
+#endif
+#if defined(CONFIG_USB_APPTABLE)
+  extern void usb_app_setup (USB_App_t* _app);
+  extern void usb_app_listen (const USB_App_t* _app, uint8_t _epfifo, uint16_t _count);
+  extern void usb_app_pending (const USB_App_t* _app, uint8_t _epfifo);
+  extern uint8_t usb_app_poll (USB_App_t* _app);
+#endif
 };
 
 namespace JTAG {
   bool dap_command_check (void);
   void jtag_scope_branch (void);
+  void jtag_scope_complete (size_t _rspsize);
+  size_t dispatch (const JTAG_Dispatch_t* _table, uint8_t _code);
 };
 
 namespace NVM::V4 {
   size_t jtag_scope_updi (void);
+  void row_commit (void);
+  bool job_busy (void);
+  size_t job_step (void);
+#if defined(CONFIG_SYS_SLOTS)
+  uint8_t slot_pages (void);
+  uint16_t slot_start (uint8_t _slot);
+  uint8_t active_slot (void);
+  bool select_slot (uint8_t _slot);
+  void log_repair (void);
+  bool log_keep (uint16_t _base);
+#endif
 };
 
 namespace SYS {
   void reboot (void);
+  void setup_vdd (void);
+  void start_vdd (void);
+  void update_vdd (bool _nvm = false);
   uint16_t get_vdd (void);
   void delay_55us (void);
   void delay_100us (void);
@@ -292,6 +470,7 @@ namespace SYS {
 };
 
 namespace USB {
+  bool is_bus_event (void);
   bool is_ep_setup (void);
   bool is_not_dap (void);
   void ep_dpi_pending (void);
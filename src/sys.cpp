@@ -19,6 +19,7 @@
 #include <avr/io.h>
 #include "api/macro_api.h"  /* interrupts, initVariant */
 #include "peripheral.h"     /* import Serial (Debug) */
+#include "configuration.h"
 #include "prototype.h"
 
 #define pinLogicPush(PIN) openDrainWriteMacro(PIN, LOW)
@@ -32,6 +33,7 @@ namespace SYS {
    * Always run it after the USB has stopped.
    */
   void reboot (void) {
+    NVM::V4::row_commit();
     D0PRINTF("<REBOOT>\r\n");
     DFLUSH();
     _PROTECTED_WRITE(RSTCTRL_SWRR, 1);
@@ -42,10 +44,19 @@ namespace SYS {
    *
    * Vdd/10 goes into MUXPOS and is divided by the internal reference voltage of 1.024V.
    * A delay of 1250us is required for the voltage to stabilize.
-   * The result is 10-bit, so multiply by 10.0 to convert to 1V * 0.0001.
-   * The ADC0 peripheral is operational only during voltage measurements.
+   * The result is 10-bit, so multiply by 10 to convert to 1mV.
+   * ADC0 stays enabled, and a new conversion is started whenever a sample
+   * is taken, so get_vdd() only returns the averaged value.
    */
-  uint16_t get_vdd (void) {
+  uint16_t vdd_sample (void) {
+    uint16_t _adc_reading = ADC0_SAMPLE;
+    _adc_reading += (_adc_reading << 3) + _adc_reading;
+    ADC0_INTFLAGS = ADC_SAMPRDY_bm;
+    ADC0_COMMAND = ADC_MODE_SINGLE_10BIT_gc | ADC_START_IMMEDIATE_gc;
+    return _adc_reading;
+  }
+
+  void setup_vdd (void) {
     CLKCTRL_MCLKTIMEBASE = F_CPU / 1000000.0;
     ADC0_INTFLAGS = ~0;
     ADC0_SAMPLE = 0;
@@ -57,10 +68,49 @@ namespace SYS {
     loop_until_bit_is_clear(ADC0_STATUS, ADC_ADCBUSY_bp);
     ADC0_COMMAND = ADC_MODE_SINGLE_10BIT_gc | ADC_START_IMMEDIATE_gc;
     loop_until_bit_is_set(ADC0_INTFLAGS, ADC_SAMPRDY_bp);
-    uint16_t _adc_reading = ADC0_SAMPLE;
-    _adc_reading += (_adc_reading << 3) + _adc_reading;
-    ADC0_CTRLA = 0;
-    return _adc_reading;
+    _vdd = vdd_sample();
+    _vdd_nvm = false;
+    _diag.vdd_min = 0xFFFF;
+    _diag.vdd_max = 0;
+  }
+
+  /*
+   * Restart the conversion right before an NVM command is issued, so that
+   * the sample is taken while the NVM is busy. A conversion is far
+   * shorter than a page write or erase, so the sample of the previous
+   * operation (say, the last erase block) is ready and is counted first.
+   * A conversion still running began before this operation, and is
+   * stopped rather than waited for.
+   */
+  void start_vdd (void) {
+    update_vdd();
+    if (bit_is_set(ADC0_STATUS, ADC_ADCBUSY_bp)) {
+      ADC0_COMMAND = ADC_MODE_SINGLE_10BIT_gc | ADC_START_STOP_gc;
+    }
+    ADC0_INTFLAGS = ADC_SAMPRDY_bm;
+    ADC0_COMMAND = ADC_MODE_SINGLE_10BIT_gc | ADC_START_IMMEDIATE_gc;
+    _vdd_nvm = true;
+  }
+
+  /*
+   * Take a finished sample, if any, into the running average.
+   * A sample started by start_vdd() also updates the min/max diagnostics.
+   * After the NVM operation (`_nvm`), that sample is waited for.
+   */
+  void update_vdd (bool _nvm) {
+    if (_nvm && _vdd_nvm) loop_until_bit_is_set(ADC0_INTFLAGS, ADC_SAMPRDY_bp);
+    if (bit_is_clear(ADC0_INTFLAGS, ADC_SAMPRDY_bp)) return;
+    uint16_t _reading = vdd_sample();
+    _vdd = (_vdd * 3 + _reading) >> 2;
+    if (_vdd_nvm) {
+      _vdd_nvm = false;
+      if (_diag.vdd_min > _reading) _diag.vdd_min = _reading;
+      if (_diag.vdd_max < _reading) _diag.vdd_max = _reading;
+    }
+  }
+
+  uint16_t get_vdd (void) {
+    return _vdd;
   }
 
   void delay_55us (void) {
@@ -67,6 +67,10 @@ namespace USB {
     0xB1, 0x02, 0xC0
   };
 
+  static_assert(sizeof(current_descriptor) <= sizeof(EP_MEM.res_data), "res_data too small");
+  static_assert(sizeof(report_descriptor)  <= sizeof(EP_MEM.res_data), "res_data too small");
+  static_assert(sizeof(mstring)            <= sizeof(EP_MEM.res_data), "res_data too small");
+
   const EP_TABLE_t PROGMEM ep_init = {
     { /* EP */
       { /* EP_REQ */
@@ -161,6 +165,9 @@ namespace USB {
 
   // MARK: Endpoint
 
+  /* Any flag counts, so that handling_bus_events() still clears the others */
+  /* (SOF, STALLED, ...) as it did when it was called on every pass.       */
+  bool is_bus_event (void) { return USB0_INTFLAGSA; }
   bool is_ep_setup (void) { return bit_is_set(EP_REQ.STATUS, USB_EPSETUP_bp); }
   bool is_not_dap (void) { return bit_is_clear(EP_DPO.STATUS, USB_BUSNAK_bp); }
   void ep_req_pending (void) { loop_until_bit_is_set(EP_REQ.STATUS, USB_BUSNAK_bp); }
@@ -201,73 +208,91 @@ namespace USB {
   // MARK: USB Session
 
   /*** USB Standard Request Enumeration. ***/
-  bool request_standard (void) {
-    bool _listen = true;
-    uint8_t bRequest = EP_MEM.req_data.bRequest;
+  /*
+   * Answers a standard request into `_res` and returns the response
+   * length, or -1 to leave it unanswered. The application services use
+   * it too, so all state comes from the arguments: `_ep_res` is the IN
+   * endpoint of EP0 and `_config` the value of SET_CONFIGURATION.
+   */
+  int16_t standard_request (const Setup_Packet_t* _req, uint8_t* _res, USB_EP_t& _ep_res,
+                            uint8_t& _config, size_t (*_descriptor)(uint8_t*, uint16_t)) {
+    int16_t _count = 0;
+    uint8_t bRequest = _req->bRequest;
     if (bRequest == 0x00) {       /* GET_STATUS */
-      EP_MEM.res_data[0] = 0;
-      EP_MEM.res_data[1] = 0;
-      EP_RES.CNT = 2;
+      _res[0] = 0;
+      _res[1] = 0;
+      _count = 2;
     }
     else if (bRequest == 0x01) {  /* CLEAR_FEATURE */
-      D1PRINTF(" CF=%02X:%02X\r\n", EP_MEM.req_data.wValue, EP_MEM.req_data.wIndex);
-      if (0 == (uint8_t)EP_MEM.req_data.wValue) {
+      D1PRINTF(" CF=%02X:%02X\r\n", _req->wValue, _req->wIndex);
+      if (0 == (uint8_t)_req->wValue) {
         /* Expects an endpoint number to be passed in. Swaps the high and low */
         /* nibbles to make it a representation of the USB controller. */
-        uint8_t _EP = USB_EP_ID_SWAP(EP_MEM.req_data.wIndex);
+        uint8_t _EP = USB_EP_ID_SWAP(_req->wIndex);
         loop_until_bit_is_clear(USB0_INTFLAGSB, USB_RMWBUSY_bp);
         USB_EP_STATUS_CLR(_EP) = USB_STALLED_bm | USB_BUSNAK_bm | USB_TOGGLE_bm;
       }
-      EP_RES.CNT = 0;
-    }
-    else if (bRequest == 0x04) {  /* SET_FEATURE */
-      /* If used, it will be ignored. */
-      D1PRINTF(" SF=%02X:%02X\r\n", EP_MEM.req_data.wValue, EP_MEM.req_data.wIndex);
-      EP_RES.CNT = 0;
     }
     else if (bRequest == 0x05) {  /* SET_ADDRESS */
-      uint8_t _addr = EP_MEM.req_data.wValue & 0x7F;
-      ep_res_listen();
-      ep_res_pending();
+      /* The status stage completes at the old address. */
+      uint8_t _addr = _req->wValue & 0x7F;
+      _ep_res.CNT = 0;
+      _ep_res.MCNT = 0;
+      loop_until_bit_is_clear(USB0_INTFLAGSB, USB_RMWBUSY_bp);
+      USB_EP_STATUS_CLR(USB_EP_RES) = ~USB_TOGGLE_bm;
+      loop_until_bit_is_set(_ep_res.STATUS, USB_BUSNAK_bp);
       USB0_ADDR = _addr;
       D1PRINTF(" USB0_ADDR=%d\r\n", _addr);
-      EP_RES.CNT = 0;
     }
     else if (bRequest == 0x06) {  /* GET_DESCRIPTOR */
-      size_t _length = EP_MEM.req_data.wLength;
-      size_t _size = get_descriptor((uint8_t*)&EP_MEM.res_data, EP_MEM.req_data.wValue);
-      EP_RES.CNT = (_size > _length) ? _length : _size;
-      _listen = !!_size;
+      size_t _length = _req->wLength;
+      size_t _size = _descriptor ? _descriptor(_res, _req->wValue) : 0;
+      if (!_size) return -1;
+      _count = (_size > _length) ? _length : _size;
     }
     else if (bRequest == 0x08) {  /* GET_CONFIGURATION */
-      EP_MEM.res_data[0] = _set_config;
-      D1PRINTF("<GC:%02X>\r\n", _set_config);
-      EP_RES.CNT = 1;
+      _res[0] = _config;
+      D1PRINTF("<GC:%02X>\r\n", _config);
+      _count = 1;
     }
     else if (bRequest == 0x09) {  /* SET_CONFIGURATION */
-      /* Once the USB connection is fully initiated, it will go through here. */
-      _set_config = (uint8_t)EP_MEM.req_data.wValue;
-      bit_set(GPCONF, GPCONF_USB_bp);
-      _led_next = 0b11110000;
-      D1PRINTF("<READY:%02X>\r\n", _set_config);
-      EP_RES.CNT = 0;
+      _config = (uint8_t)_req->wValue;
     }
     else if (bRequest == 0x0A) {  /* GET_INTREFACE */
       /* It seems not to be used. */
       D1PRINTF("<SI:0>\r\n");
-      EP_MEM.res_data[0] = 0;
-      EP_RES.CNT = 1;
+      _res[0] = 0;
+      _count = 1;
+    }
+    else if (bRequest == 0x04) {  /* SET_FEATURE */
+      /* If used, it will be ignored. */
+      D1PRINTF(" SF=%02X:%02X\r\n", _req->wValue, _req->wIndex);
     }
     else if (bRequest == 0x0B) {  /* SET_INTREFACE */
       /* It seems not to be used. */
-      D1PRINTF("<GI:%02X>\r\n", EP_MEM.req_data.wValue);
-      EP_RES.CNT = 0;
+      D1PRINTF("<GI:%02X>\r\n", _req->wValue);
     }
     else {
-      D2PRINTF(" RQ=%02X\r\n", bRequest);
-      _listen = false;
+      _count = -1;
     }
-    return _listen;
+    return _count;
+  }
+
+  bool request_standard (void) {
+    int16_t _count = standard_request(&EP_MEM.req_data, &EP_MEM.res_data[0],
+      EP_RES, _set_config, &get_descriptor);
+    if (_count < 0) {
+      D2PRINTF(" RQ=%02X\r\n", EP_MEM.req_data.bRequest);
+      return false;
+    }
+    EP_RES.CNT = _count;
+    if (EP_MEM.req_data.bRequest == 0x09) {
+      /* Once the USB connection is fully initiated, it will go through here. */
+      bit_set(GPCONF, GPCONF_USB_bp);
+      _led_next = 0b11110000;
+      D1PRINTF("<READY:%02X>\r\n", _set_config);
+    }
+    return true;
   }
 
   /*** class request processing. ***/
@@ -333,6 +358,103 @@ namespace USB {
     }
   }
 
+#if defined(CONFIG_USB_APPTABLE)
+
+  // MARK: Application services
+
+  /* Same offsets as USB_EP_REQ/USB_EP_RES, on the application's table. */
+  USB_EP_t& app_ep (const USB_App_t* _app, uint8_t _epfifo) {
+    return *(USB_EP_t*)((uint16_t)_app->ep_table + _epfifo);
+  }
+
+  /*
+   * The standard requests are answered by standard_request() as for the
+   * bootloader, but all state lives in the USB_App_t, because the
+   * bootloader RAM belongs to the application at this point.
+   */
+  void app_control (USB_App_t* _app) {
+    Setup_Packet_t* _req = (Setup_Packet_t*)app_ep(_app, USB_EP_REQ).DATAPTR;
+    uint8_t* _res = (uint8_t*)app_ep(_app, USB_EP_RES).DATAPTR;
+    int16_t _count = -1;
+    uint8_t bmRequestType = _req->bmRequestType;
+    if (bit_is_clear(bmRequestType, 7)) usb_app_listen(_app, USB_EP_REQ, 0);
+    if (bmRequestType & (3 << 5)) {
+      /* Class and vendor requests belong to the application. */
+      if (_app->request) _count = _app->request(_req, _res);
+    }
+    else {
+      _count = standard_request(_req, _res, app_ep(_app, USB_EP_RES), _app->config, _app->descriptor);
+    }
+    if (_count >= 0) {
+      usb_app_listen(_app, USB_EP_RES, _count);
+      usb_app_listen(_app, USB_EP_REQ, 0);
+    }
+    USB0_INTFLAGSB |= USB_EPSETUP_bp;
+  }
+
+#endif
+
 };
 
+#if defined(CONFIG_USB_APPTABLE)
+
+/*
+ * Entries of the ABI version 2 table. These only touch the USB peripheral
+ * and the USB_App_t passed in, so they can be called from an application.
+ * `_epfifo` is the internal endpoint offset: (EP number << 4) | (IN ? 8 : 0).
+ */
+extern "C" {
+
+  /* $2E: Attach with the application's endpoint table. */
+  __attribute__((used))
+  void usb_app_setup (USB_App_t* _app) {
+    USB0_CTRLA = 0;
+    USB0_ADDR = 0;
+    USB0_FIFOWP = 0;
+    USB0_EPPTR = (uint16_t)_app->ep_table;
+    USB0_CTRLB = USB_ATTACH_bm;
+    _app->config = 0;
+    memcpy_P(_app->ep_table, _app->ep_init, _app->ep_count * sizeof(USB_EP_PAIR_t));
+    USB0_CTRLA = USB_ENABLE_bm | (_app->ep_count - 1);
+  }
+
+  /* $30: Arm an endpoint. An IN endpoint sends `_count` bytes. */
+  __attribute__((used))
+  void usb_app_listen (const USB_App_t* _app, uint8_t _epfifo, uint16_t _count) {
+    USB_EP_t& _ep = USB::app_ep(_app, _epfifo);
+    if (_epfifo & 8) {
+      _ep.CNT = _count;
+      _ep.MCNT = 0;
+    }
+    else _ep.CNT = 0;
+    loop_until_bit_is_clear(USB0_INTFLAGSB, USB_RMWBUSY_bp);
+    USB_EP_STATUS_CLR(_epfifo) = ~USB_TOGGLE_bm;
+  }
+
+  /* $32: Wait until the endpoint has finished its transaction. */
+  __attribute__((used))
+  void usb_app_pending (const USB_App_t* _app, uint8_t _epfifo) {
+    loop_until_bit_is_set(USB::app_ep(_app, _epfifo).STATUS, USB_BUSNAK_bp);
+  }
+
+  /*
+   * $34: Handle a bus reset and an EP0 SETUP, if either is pending.
+   * Returns the RESET/RESUME flags seen, so that the application can
+   * react to a resume (cable unplugged) itself.
+   */
+  __attribute__((used))
+  uint8_t usb_app_poll (USB_App_t* _app) {
+    uint8_t _busstate = USB0_INTFLAGSA & (USB_RESET_bm | USB_RESUME_bm);
+    if (_busstate) {
+      USB0_INTFLAGSA = _busstate;
+      if (bit_is_set(_busstate, USB_RESET_bp)) usb_app_setup(_app);
+    }
+    if (bit_is_set(USB::app_ep(_app, USB_EP_REQ).STATUS, USB_EPSETUP_bp)) USB::app_control(_app);
+    return _busstate;
+  }
+
+};
+
+#endif
+
 // end of code
@@ -0,0 +1,533 @@
+/**
+ * @file genpkg.cpp
+ * @author askn (K.Sato) multix.jp
+ * @brief Host tool to build differential update bundles for `euboot`.
+ *        The new image is CRC-stamped exactly like `gencrc.pl -u -c6`,
+ *        split into pages, and each page is stored as unchanged, erased,
+ *        a compressed full page or a compressed delta to the old image.
+ * @version 0.1
+ * @date 2024-11-01
+ *
+ * @copyright Copyright (c) 2024 askn37 at github.com
+ *
+ */
+// MIT License : https://askn37.github.io/LICENSE.html
+
+/*
+ * Build: c++ -O2 -std=c++17 -o genpkg tools/genpkg.cpp
+ *
+ * Bundle layout (all words little-endian):
+ *
+ *   Header   : "EUPK" [VER] [PAGE_SHIFT] [PAGES x 2] [BASE x 4]
+ *              [OLD_CRC x 4] [NEW_CRC x 4] [FOOTER x 4] [FOOTER_POS x 4]
+ *   Manifest : PAGES x { [KIND] [reserved] [LEN x 2] }
+ *   Payload  : LEN bytes for each FULL and DELTA page, in page order
+ *
+ *   KIND 0 SAME   : page is identical to the old image
+ *        1 ERASED : page is all 0xFF, erase only
+ *        2 FULL   : PackBits of the new page
+ *        3 DELTA  : PackBits of (new XOR old)
+ *
+ *   OLD_CRC and NEW_CRC are CRC-32 (`gencrc.pl -c6` model, Xout) of the
+ *   old and new image over PAGES pages, padded with 0xFF. FOOTER is the
+ *   CRCSCAN word stored at FOOTER_POS of the new image.
+ */
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+namespace {
+
+  typedef std::vector<uint8_t> Bytes;
+
+  const size_t MAX_LIMIT = 128 * 1024;  /* same limit as gencrc.pl */
+
+  const char* usage =
+    "\n"
+    "Usage: genpkg [OPTIONS] [FILE ...]\n"
+    "\n"
+    "  -i <file>   New application image. (Required unless -B)\n"
+    "  -r <file>   Old application image to diff against.\n"
+    "              Without it, every page is stored in full.\n"
+    "  -o <file>   Output bundle file.\n"
+    "              Input files ending in `.hex` are read as Intel-HEX,\n"
+    "              others as binary.\n"
+    "  -p <num>    Page size granularity:\n"
+    "                1 256 byte page\n"
+    "                2 512 byte page : Default value\n"
+    "                4 1024 byte page\n"
+    "  -g <file>   Check the stamped image bit-exactly against\n"
+    "              the output of `perl <file> -u -c6` (gencrc.pl).\n"
+    "  -B <num>    Benchmark: package each FILE against the one before it\n"
+    "              <num> times and report the throughput.\n"
+    "  -h          Print this usage.\n"
+    "  -q          Quiet report.\n"
+    "\n";
+
+  // MARK: CRC-32/XOR (gencrc.pl model 6)
+
+  const uint32_t CRC_INITIALIZE = 0xffffffff;
+  const uint32_t CRC_POLYNOMIAL = 0xedb88320;
+  const uint32_t CRC_FINALIZE   = 0xdebb20e3;  /* magicnumber */
+  const uint32_t CRC_XOR        = 0xffffffff;
+  const uint32_t CRC_UNWINDING  = 0xdb710641;  /* (P << 1) | 1 */
+
+  uint32_t crc_table[256];
+
+  void crc_setup (void) {
+    for (uint32_t _i = 0; _i < 256; _i++) {
+      uint32_t _crc = _i;
+      for (int _j = 0; _j < 8; _j++) _crc = (_crc >> 1) ^ (CRC_POLYNOMIAL & -(_crc & 1));
+      crc_table[_i] = _crc;
+    }
+  }
+
+  /* Table form of encoder_crc32_ror(). */
+  uint32_t encoder (uint32_t _crc, const uint8_t* _data, size_t _length) {
+    while (_length--) _crc = (_crc >> 8) ^ crc_table[(_crc ^ *_data++) & 0xff];
+    return _crc;
+  }
+
+  uint32_t trimmer (uint32_t _crc, size_t _topend, size_t _length) {
+    for (size_t _i = _length; _i < _topend; _i++) _crc = (_crc >> 8) ^ crc_table[(_crc ^ 0xff) & 0xff];
+    return _crc;
+  }
+
+  /* Bitwise port of decoder() and decoder_crc32_ror(). */
+  uint32_t decoder (size_t _topend, size_t _length, const Bytes& _buff) {
+    uint32_t _crc = CRC_FINALIZE;
+    for (size_t _i = _topend; _i-- > _length; ) {
+      for (int _j = 0; _j < 8; _j++) _crc = (_crc << 1) ^ (CRC_UNWINDING & -((_crc >> 31) & 1));
+      _crc ^= _i < _buff.size() ? _buff[_i] : 0xff;
+    }
+    return _crc;
+  }
+
+  uint32_t get_le32 (const uint8_t* _p) {
+    return _p[0] | (_p[1] << 8) | (_p[2] << 16) | ((uint32_t)_p[3] << 24);
+  }
+
+  void put_le (Bytes& _out, uint32_t _value, int _size) {
+    while (_size--) {
+      _out.push_back(_value & 0xff);
+      _value >>= 8;
+    }
+  }
+
+  /*
+   * Same result as `gencrc.pl -u -c6 -o` without -a/-t/-b/-x:
+   * the CRC word is placed right after the code (or kept, if the image
+   * already passes), so that the CRC over whole pages padded with 0xFF
+   * leaves the magic number. Returns the footer word.
+   */
+  uint32_t stamp (Bytes& _stream, size_t _page_size, size_t& _position, size_t& _topend) {
+    size_t _length = _stream.size();
+    size_t _border = (_length + _page_size - 1) / _page_size;
+    if (_border < 1) _border = 1;
+    _topend = _border * _page_size;
+    uint32_t _crc  = encoder(CRC_INITIALIZE, _stream.data(), _length);
+    uint32_t _enti = trimmer(_crc, _topend, _length);
+    uint32_t _fixd;
+    if (_enti != CRC_FINALIZE) {
+      if (((_length + 4) % _page_size) <= 4) _topend += _page_size;
+      _fixd = ~_crc ^ decoder(_topend, _length, _stream);
+    }
+    else {
+      _length -= 4;
+      _fixd = get_le32(&_stream[_length]);
+    }
+    if (_stream.size() < _length + 4) _stream.resize(_length + 4);
+    for (int _i = 0; _i < 4; _i++) _stream[_length + _i] = _fixd >> (_i * 8);
+    _position = _length;
+    return _fixd;
+  }
+
+  // MARK: Image input
+
+  int hex_digit (char _c) {
+    if (_c >= '0' && _c <= '9') return _c - '0';
+    if (_c >= 'A' && _c <= 'F') return _c - 'A' + 10;
+    if (_c >= 'a' && _c <= 'f') return _c - 'a' + 10;
+    return -1;
+  }
+
+  bool has_suffix (const std::string& _name, const char* _suffix) {
+    size_t _n = strlen(_suffix);
+    if (_name.size() < _n) return false;
+    for (size_t _i = 0; _i < _n; _i++) {
+      char _c = _name[_name.size() - _n + _i];
+      if (_c >= 'A' && _c <= 'Z') _c += 'a' - 'A';
+      if (_c != _suffix[_i]) return false;
+    }
+    return true;
+  }
+
+  /*
+   * Read like gencrc.pl: data is relative to the first data record, and
+   * every record other than EOF is appended at its address, so that the
+   * stamped result stays identical.
+   */
+  bool read_image (const std::string& _name, Bytes& _stream, uint32_t& _start) {
+    std::ifstream _fh(_name, std::ios::binary);
+    if (!_fh) {
+      fprintf(stderr, "Illegal: %s not found.\n", _name.c_str());
+      return false;
+    }
+    _stream.clear();
+    _start = 0;
+    if (!has_suffix(_name, ".hex")) {
+      _stream.assign(std::istreambuf_iterator<char>(_fh), std::istreambuf_iterator<char>());
+    }
+    else {
+      std::string _line;
+      uint32_t _offset = 0;
+      bool _first = true;
+      size_t _lineno = 0;
+      while (std::getline(_fh, _line)) {
+        _lineno++;
+        size_t _colon = _line.find(':');
+        if (_colon == std::string::npos) continue;
+        Bytes _rec;
+        for (size_t _i = _colon + 1; _i + 1 < _line.size(); _i += 2) {
+          int _h = hex_digit(_line[_i]), _l = hex_digit(_line[_i + 1]);
+          if (_h < 0 || _l < 0) break;
+          _rec.push_back((_h << 4) | _l);
+        }
+        uint8_t _sum = 0;
+        for (uint8_t _b : _rec) _sum += _b;
+        if (_rec.size() < 5 || _sum != 0 || _rec.size() < (size_t)_rec[0] + 5) {
+          fprintf(stderr, "warning: ihex checksum doesn't match line %zu\n", _lineno);
+          continue;
+        }
+        uint32_t _addr = (_rec[1] << 8) | _rec[2];
+        uint8_t  _type = _rec[3];
+        const uint8_t* _data = &_rec[4];
+        size_t _len = _rec[0];
+        if (_type == 1) break;
+        else if (_type == 4) {
+          if (_len >= 2) _offset = ((_data[0] << 8) | _data[1]) << 16;
+        }
+        else if (_type == 0) {
+          if (_first) {
+            _start = _addr;
+            _first = false;
+          }
+          _addr = _addr + _offset - _start;
+        }
+        if ((int32_t)_addr > (int32_t)MAX_LIMIT) break;
+        if ((int32_t)_addr > (int32_t)_stream.size()) _stream.resize(_addr, 0xff);
+        _stream.insert(_stream.end(), _data, _data + _len);
+      }
+    }
+    if (_stream.size() > MAX_LIMIT) {
+      fprintf(stderr, "Illegal: %s size is too large.\n", _name.c_str());
+      return false;
+    }
+    return true;
+  }
+
+  // MARK: PackBits
+
+  /*
+   * [0..127] copies N+1 literal bytes, [129..255] repeats the next byte
+   * 257-N times. A run of 2 is only taken between runs, so the output
+   * depends on the input alone.
+   */
+  void packbits (const uint8_t* _src, size_t _size, Bytes& _out) {
+    size_t _i = 0;
+    while (_i < _size) {
+      size_t _run = 1;
+      while (_i + _run < _size && _run < 128 && _src[_i + _run] == _src[_i]) _run++;
+      if (_run >= 3 || (_run == 2 && (_i + 2 == _size || _i == 0))) {
+        _out.push_back(257 - _run);
+        _out.push_back(_src[_i]);
+        _i += _run;
+        continue;
+      }
+      size_t _lit = 0;
+      while (_i + _lit < _size && _lit < 128) {
+        if (_i + _lit + 2 < _size
+         && _src[_i + _lit] == _src[_i + _lit + 1]
+         && _src[_i + _lit] == _src[_i + _lit + 2]) break;
+        _lit++;
+      }
+      _out.push_back(_lit - 1);
+      _out.insert(_out.end(), _src + _i, _src + _i + _lit);
+      _i += _lit;
+    }
+  }
+
+  bool unpackbits (const uint8_t* _src, size_t _size, uint8_t* _dst, size_t _limit) {
+    size_t _o = 0;
+    for (size_t _i = 0; _i < _size; ) {
+      uint8_t _n = _src[_i++];
+      if (_n < 128) {
+        size_t _lit = _n + 1;
+        if (_i + _lit > _size || _o + _lit > _limit) return false;
+        memcpy(_dst + _o, _src + _i, _lit);
+        _i += _lit;
+        _o += _lit;
+      }
+      else if (_n > 128) {
+        size_t _run = 257 - _n;
+        if (_i >= _size || _o + _run > _limit) return false;
+        memset(_dst + _o, _src[_i++], _run);
+        _o += _run;
+      }
+    }
+    return _o == _limit;
+  }
+
+  // MARK: Bundle
+
+  enum { KIND_SAME = 0, KIND_ERASED = 1, KIND_FULL = 2, KIND_DELTA = 3 };
+
+  struct Summary {
+    size_t pages;
+    size_t counts[4];
+    size_t footer_pos;
+    uint32_t footer;
+  };
+
+  const size_t HEADER_SIZE = 28;
+
+  /* `_new` is stamped in place. `_old` may be empty. */
+  void build_bundle (Bytes& _new, const Bytes& _old, uint32_t _base, size_t _page_size, Bytes& _bundle, Summary& _sum) {
+    size_t _topend;
+    _sum.footer = stamp(_new, _page_size, _sum.footer_pos, _topend);
+    size_t _pages = _topend / _page_size;
+    _sum.pages = _pages;
+    memset(_sum.counts, 0, sizeof(_sum.counts));
+
+    Bytes _newp(_new), _oldp(_old);
+    _newp.resize(_topend, 0xff);
+    _oldp.resize(_topend, 0xff);
+
+    Bytes _manifest, _payload, _full, _delta, _xor(_page_size);
+    for (size_t _p = 0; _p < _pages; _p++) {
+      const uint8_t* _np = &_newp[_p * _page_size];
+      const uint8_t* _op = &_oldp[_p * _page_size];
+      uint8_t  _kind;
+      size_t   _len = 0;
+      bool _erased = true;
+      for (size_t _i = 0; _i < _page_size; _i++) if (_np[_i] != 0xff) { _erased = false; break; }
+      if (!_old.empty() && !memcmp(_np, _op, _page_size)) _kind = KIND_SAME;
+      else if (_erased) _kind = KIND_ERASED;
+      else {
+        _full.clear();
+        packbits(_np, _page_size, _full);
+        _kind = KIND_FULL;
+        if (!_old.empty()) {
+          for (size_t _i = 0; _i < _page_size; _i++) _xor[_i] = _np[_i] ^ _op[_i];
+          _delta.clear();
+          packbits(_xor.data(), _page_size, _delta);
+          if (_delta.size() < _full.size()) {
+            _kind = KIND_DELTA;
+            _full.swap(_delta);
+          }
+        }
+        _len = _full.size();
+        _payload.insert(_payload.end(), _full.begin(), _full.end());
+      }
+      _sum.counts[_kind]++;
+      _manifest.push_back(_kind);
+      _manifest.push_back(0);
+      put_le(_manifest, _len, 2);
+    }
+
+    uint8_t _shift = 0;
+    while ((1u << _shift) < _page_size) _shift++;
+    _bundle.clear();
+    _bundle.insert(_bundle.end(), { 'E', 'U', 'P', 'K', 1, _shift });
+    put_le(_bundle, _pages, 2);
+    put_le(_bundle, _base, 4);
+    put_le(_bundle, encoder(CRC_INITIALIZE, _oldp.data(), _topend) ^ CRC_XOR, 4);
+    put_le(_bundle, encoder(CRC_INITIALIZE, _newp.data(), _topend) ^ CRC_XOR, 4);
+    put_le(_bundle, _sum.footer, 4);
+    put_le(_bundle, _sum.footer_pos, 4);
+    _bundle.insert(_bundle.end(), _manifest.begin(), _manifest.end());
+    _bundle.insert(_bundle.end(), _payload.begin(), _payload.end());
+  }
+
+  /* Rebuild the new image from the bundle and the old image. */
+  bool apply_bundle (const Bytes& _bundle, const Bytes& _old, Bytes& _out) {
+    if (_bundle.size() < HEADER_SIZE || memcmp(_bundle.data(), "EUPK", 4) || _bundle[4] != 1) return false;
+    size_t _page_size = (size_t)1 << _bundle[5];
+    size_t _pages = _bundle[6] | (_bundle[7] << 8);
+    size_t _topend = _pages * _page_size;
+    Bytes _oldp(_old);
+    _oldp.resize(_topend, 0xff);
+    if (get_le32(&_bundle[12]) != (encoder(CRC_INITIALIZE, _oldp.data(), _topend) ^ CRC_XOR)) return false;
+    const uint8_t* _man = &_bundle[HEADER_SIZE];
+    size_t _at = HEADER_SIZE + _pages * 4;
+    if (_at > _bundle.size()) return false;
+    _out.assign(_topend, 0xff);
+    for (size_t _p = 0; _p < _pages; _p++, _man += 4) {
+      uint8_t* _dst = &_out[_p * _page_size];
+      const uint8_t* _op = &_oldp[_p * _page_size];
+      size_t _len = _man[2] | (_man[3] << 8);
+      if (_at + _len > _bundle.size()) return false;
+      if (_man[0] == KIND_SAME) memcpy(_dst, _op, _page_size);
+      else if (_man[0] == KIND_FULL || _man[0] == KIND_DELTA) {
+        if (!unpackbits(&_bundle[_at], _len, _dst, _page_size)) return false;
+        if (_man[0] == KIND_DELTA) for (size_t _i = 0; _i < _page_size; _i++) _dst[_i] ^= _op[_i];
+      }
+      else if (_man[0] != KIND_ERASED) return false;
+      _at += _len;
+    }
+    return _at == _bundle.size()
+        && get_le32(&_bundle[16]) == (encoder(CRC_INITIALIZE, _out.data(), _topend) ^ CRC_XOR)
+        && trimmer(encoder(CRC_INITIALIZE, _out.data(), _topend), _topend, _topend) == CRC_FINALIZE;
+  }
+
+  // MARK: gencrc.pl check
+
+  /*
+   * Runs `perl gencrc.pl -u -c6 -F` on the unstamped image and compares
+   * its output file with our stamped image, byte for byte.
+   */
+  bool gencrc_check (const std::string& _gencrc, const Bytes& _input, const Bytes& _stamped) {
+    char _in[] = "/tmp/genpkgXXXXXX";
+    int _fd = mkstemp(_in);
+    if (_fd < 0) return false;
+    close(_fd);
+    std::string _out = std::string(_in) + ".out";
+    std::ofstream(_in, std::ios::binary).write((const char*)_input.data(), _input.size());
+    std::string _cmd = "perl '" + _gencrc + "' -u -c6 -F -q -i '" + _in + "' -o '" + _out + "' >/dev/null";
+    int _rc = system(_cmd.c_str());
+    std::ifstream _fh(_out, std::ios::binary);
+    Bytes _ref((std::istreambuf_iterator<char>(_fh)), std::istreambuf_iterator<char>());
+    unlink(_in);
+    unlink(_out.c_str());
+    return _rc == 0 && _ref == _stamped;
+  }
+
+  // MARK: Benchmark
+
+  int benchmark (const std::vector<std::string>& _files, long _rounds, size_t _page_size) {
+    std::vector<Bytes> _images(_files.size());
+    uint32_t _start;
+    for (size_t _k = 0; _k < _files.size(); _k++) {
+      if (!read_image(_files[_k], _images[_k], _start)) return 1;
+    }
+    size_t _bytes = 0, _bundles = 0, _out = 0;
+    Bytes _new, _bundle;
+    Summary _sum;
+    auto _t0 = std::chrono::steady_clock::now();
+    for (long _r = 0; _r < _rounds; _r++) {
+      for (size_t _k = 0; _k < _images.size(); _k++) {
+        _new = _images[_k];
+        build_bundle(_new, _k ? _images[_k - 1] : Bytes(), 0, _page_size, _bundle, _sum);
+        _bytes += _new.size();
+        _out += _bundle.size();
+        _bundles++;
+      }
+    }
+    double _sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - _t0).count();
+    printf("Bench-images: %zu x %ld\n", _images.size(), _rounds);
+    printf("Bench-time: %.3f s\n", _sec);
+    printf("Bench-rate: %.1f bundles/s %.2f MiB/s\n", _bundles / _sec, _bytes / _sec / 1048576.0);
+    printf("Bench-ratio: %.1f%%\n", _bytes ? 100.0 * _out / _bytes : 0.0);
+    return 0;
+  }
+
+};
+
+// MARK: main
+
+int main (int argc, char** argv) {
+  std::string _infile, _oldfile, _outfile, _gencrc;
+  size_t _page_size = 512;
+  bool _quiet = false;
+  long _rounds = 0;
+  int _opt;
+  while ((_opt = getopt(argc, argv, "hqi:r:o:p:g:B:")) != -1) {
+    switch (_opt) {
+      case 'i': _infile = optarg; break;
+      case 'r': _oldfile = optarg; break;
+      case 'o': _outfile = optarg; break;
+      case 'p': _page_size = atoi(optarg) * 256; break;
+      case 'g': _gencrc = optarg; break;
+      case 'q': _quiet = true; break;
+      case 'B': _rounds = atol(optarg); break;
+      default : fputs(usage, stderr); return 2;
+    }
+  }
+  if (_page_size != 256 && _page_size != 512 && _page_size != 1024) {
+    fputs("Illegal: -p <num>\n", stderr);
+    fputs(usage, stderr);
+    return 2;
+  }
+  crc_setup();
+
+  if (_rounds > 0) {
+    std::vector<std::string> _files(argv + optind, argv + argc);
+    if (_files.empty()) {
+      fputs(usage, stderr);
+      return 2;
+    }
+    return benchmark(_files, _rounds, _page_size);
+  }
+  if (_infile.empty()) {
+    fputs(usage, stderr);
+    return 2;
+  }
+
+  Bytes _new, _old, _bundle, _check_out;
+  uint32_t _base = 0, _old_base = 0;
+  if (!read_image(_infile, _new, _base)) return 1;
+  if (!_oldfile.empty()) {
+    if (!read_image(_oldfile, _old, _old_base)) return 1;
+    if (_old_base != _base) {
+      fprintf(stderr, "Illegal: -r image starts at $%06X, -i image at $%06X.\n", _old_base, _base);
+      return 1;
+    }
+  }
+  Bytes _input(_new);
+  Summary _sum;
+  build_bundle(_new, _old, _base, _page_size, _bundle, _sum);
+
+  if (!apply_bundle(_bundle, _old, _check_out)
+   || memcmp(_check_out.data(), _new.data(), _new.size())) {
+    fputs("*** Error: bundle does not rebuild the new image.\n", stderr);
+    return 1;
+  }
+  if (!_gencrc.empty() && !gencrc_check(_gencrc, _input, _new)) {
+    fputs("*** Error: CRC footer differs from gencrc.pl.\n", stderr);
+    return 1;
+  }
+
+  if (!_quiet) {
+    printf("Input-file: %s\n", _infile.c_str());
+    printf("Input-size: %zu\n", _input.size());
+    if (!_oldfile.empty()) printf("Base-file: %s\n", _oldfile.c_str());
+    printf("Page-size: %zu\n", _page_size);
+    printf("Page-length: %zu\n", _sum.pages);
+    printf("Pages: same=%zu erased=%zu full=%zu delta=%zu\n",
+      _sum.counts[KIND_SAME], _sum.counts[KIND_ERASED], _sum.counts[KIND_FULL], _sum.counts[KIND_DELTA]);
+    printf("Fixed-CRC32: %08X (LE)%s\n", _sum.footer, _gencrc.empty() ? "" : " (gencrc Good)");
+    printf("Position: $%06zX\n", _sum.footer_pos);
+    printf("Bundle-size: %zu\n", _bundle.size());
+  }
+  else {
+    printf("%08X\n", _sum.footer);
+  }
+
+  if (!_outfile.empty()) {
+    std::ofstream _fh(_outfile, std::ios::binary);
+    if (!_fh.write((const char*)_bundle.data(), _bundle.size())) {
+      fprintf(stderr, "*** Error: cannot write %s\n", _outfile.c_str());
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// end of code